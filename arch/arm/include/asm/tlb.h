@@ -61,10 +61,39 @@ struct mmu_gather {
 	unsigned int		max;
 	struct page		**pages;
 	struct page		*local[MMU_GATHER_BUNDLE];
+#ifdef CONFIG_HAVE_RCU_TABLE_FREE
+	struct mmu_table_batch	*batch;
+	unsigned int		need_flush;
+#endif
 };
 
 DECLARE_PER_CPU(struct mmu_gather, mmu_gathers);
 
+#ifdef CONFIG_HAVE_RCU_TABLE_FREE
+/*
+ * Page tables are freed after an RCU-sched grace period, so that walkers
+ * running with interrupts disabled and without mmap_sem (the speculative
+ * page fault handler) never see a table reused under them.  See the
+ * comment in asm-generic/tlb.h.
+ */
+static inline void __tlb_remove_table(void *_table)
+{
+	free_page_and_swap_cache((struct page *)_table);
+}
+
+struct mmu_table_batch {
+	struct rcu_head		rcu;
+	unsigned int		nr;
+	void			*tables[0];
+};
+
+#define MAX_TABLE_BATCH		\
+	((PAGE_SIZE - sizeof(struct mmu_table_batch)) / sizeof(void *))
+
+extern void tlb_table_flush(struct mmu_gather *tlb);
+extern void tlb_remove_table(struct mmu_gather *tlb, void *table);
+#endif /* CONFIG_HAVE_RCU_TABLE_FREE */
+
 /*
  * This is unnecessarily complex.  There's three ways the TLB shootdown
  * code is used:
@@ -112,6 +141,9 @@ static inline void __tlb_alloc_page(struct mmu_gather *tlb)
 static inline void tlb_flush_mmu(struct mmu_gather *tlb)
 {
 	tlb_flush(tlb);
+#ifdef CONFIG_HAVE_RCU_TABLE_FREE
+	tlb_table_flush(tlb);
+#endif
 	if (!tlb_fast_mode(tlb)) {
 		free_pages_and_swap_cache(tlb->pages, tlb->nr);
 		tlb->nr = 0;
@@ -130,6 +162,9 @@ tlb_gather_mmu(struct mmu_gather *tlb, struct mm_struct *mm, unsigned int fullmm
 	tlb->pages = tlb->local;
 	tlb->nr = 0;
 	__tlb_alloc_page(tlb);
+#ifdef CONFIG_HAVE_RCU_TABLE_FREE
+	tlb->batch = NULL;
+#endif
 }
 
 static inline void
@@ -153,6 +188,13 @@ tlb_remove_tlb_entry(struct mmu_gather *tlb, pte_t *ptep, unsigned long addr)
 	tlb_add_flush(tlb, addr);
 }
 
+/*
+ * A TLB invalidate by MVA also removes any block (huge) entry covering
+ * that address, so a single flush is enough for a huge PMD.
+ */
+#define tlb_remove_pmd_tlb_entry(tlb, pmdp, addr)	\
+	tlb_add_flush(tlb, addr)
+
 /*
  * In the case of tlb vma handling, we can optimise these away in the
  * case where we're doing a full MM flush.  When we're doing a munmap,
@@ -194,6 +236,22 @@ static inline void tlb_remove_page(struct mmu_gather *tlb, struct page *page)
 		tlb_flush_mmu(tlb);
 }
 
+/*
+ * Free a page table.  Only RCU-free it when other threads could be walking
+ * it: tlb_remove_table() frees tables of a single-user mm at once, ahead of
+ * the TLB flush, which the ARMv7 table walker does not allow for.
+ */
+static inline void tlb_remove_entry(struct mmu_gather *tlb, struct page *page)
+{
+#ifdef CONFIG_HAVE_RCU_TABLE_FREE
+	if (atomic_read(&tlb->mm->mm_users) > 1) {
+		tlb_remove_table(tlb, page);
+		return;
+	}
+#endif
+	tlb_remove_page(tlb, page);
+}
+
 static inline void __pte_free_tlb(struct mmu_gather *tlb, pgtable_t pte,
 	unsigned long addr)
 {
@@ -207,7 +265,7 @@ static inline void __pte_free_tlb(struct mmu_gather *tlb, pgtable_t pte,
 	tlb_add_flush(tlb, addr + SZ_1M - PAGE_SIZE);
 	tlb_add_flush(tlb, addr + SZ_1M);
 
-	tlb_remove_page(tlb, pte);
+	tlb_remove_entry(tlb, pte);
 }
 
 static inline void __pmd_free_tlb(struct mmu_gather *tlb, pmd_t *pmdp,
@@ -215,7 +273,7 @@ static inline void __pmd_free_tlb(struct mmu_gather *tlb, pmd_t *pmdp,
 {
 #ifdef CONFIG_ARM_LPAE
 	tlb_add_flush(tlb, addr);
-	tlb_remove_page(tlb, virt_to_page(pmdp));
+	tlb_remove_entry(tlb, virt_to_page(pmdp));
 #endif
 }
 
@@ -282,6 +282,24 @@ do_page_fault(unsigned long addr, unsigned int fsr, struct pt_regs *regs)
 	if (in_atomic() || !mm)
 		goto no_context;
 
+	/*
+	 * Try to handle the fault without mmap_sem first, so that faulting
+	 * threads don't queue up behind a thread doing mmap() or munmap().
+	 * Prefetch aborts need access_error()'s VM_EXEC check and are left
+	 * to the normal path.
+	 */
+	if (!(fsr & FSR_LNX_PF) &&
+	    (user_mode(regs) || search_exception_tables(regs->ARM_pc))) {
+		fault = handle_speculative_fault(mm, addr, flags);
+		if (fault != VM_FAULT_RETRY) {
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS, 1, regs, addr);
+			tsk->min_flt++;
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1,
+					regs, addr);
+			return 0;
+		}
+	}
+
 	/*
 	 * As per x86, we may deadlock here.  However, since the kernel only
 	 * validly references user space from well defined areas of the code,
@@ -16,6 +16,7 @@
 #include <linux/netdevice.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <net/netlink.h>
 #include <asm/cacheflush.h>
 #include <asm/hwcap.h>
 
@@ -71,36 +72,90 @@ struct jit_ctx {
 
 int bpf_jit_enable __read_mostly;
 
-static u64 jit_get_skb_b(struct sk_buff *skb, unsigned offset)
+/*
+ * The slowpath helpers return the loaded value in the low word and a
+ * non-zero error in the high word. Negative offsets are relative to
+ * the network or link layer header (SKF_NET_OFF, SKF_LL_OFF).
+ */
+static int jit_copy_bits(struct sk_buff *skb, int offset, void *to, int len)
+{
+	u8 *ptr;
+
+	if (offset >= 0)
+		return skb_copy_bits(skb, offset, to, len);
+
+	ptr = bpf_internal_load_pointer_neg_helper(skb, offset, len);
+	if (ptr == NULL)
+		return -EFAULT;
+	memcpy(to, ptr, len);
+	return 0;
+}
+
+static u64 jit_get_skb_b(struct sk_buff *skb, int offset)
 {
 	u8 ret;
 	int err;
 
-	err = skb_copy_bits(skb, offset, &ret, 1);
+	err = jit_copy_bits(skb, offset, &ret, 1);
 
 	return (u64)err << 32 | ret;
 }
 
-static u64 jit_get_skb_h(struct sk_buff *skb, unsigned offset)
+static u64 jit_get_skb_h(struct sk_buff *skb, int offset)
 {
 	u16 ret;
 	int err;
 
-	err = skb_copy_bits(skb, offset, &ret, 2);
+	err = jit_copy_bits(skb, offset, &ret, 2);
 
 	return (u64)err << 32 | ntohs(ret);
 }
 
-static u64 jit_get_skb_w(struct sk_buff *skb, unsigned offset)
+static u64 jit_get_skb_w(struct sk_buff *skb, int offset)
 {
 	u32 ret;
 	int err;
 
-	err = skb_copy_bits(skb, offset, &ret, 4);
+	err = jit_copy_bits(skb, offset, &ret, 4);
 
 	return (u64)err << 32 | ntohl(ret);
 }
 
+/* Same semantics as the BPF_S_ANC_NLATTR{,_NEST} cases in sk_run_filter() */
+static u64 jit_nlattr(struct sk_buff *skb, u32 A, u32 X)
+{
+	struct nlattr *nla;
+
+	if (skb_is_nonlinear(skb))
+		return (u64)1 << 32;
+	if (A > skb->len - sizeof(struct nlattr))
+		return (u64)1 << 32;
+
+	nla = nla_find((struct nlattr *)&skb->data[A], skb->len - A, X);
+	if (nla)
+		return (void *)nla - (void *)skb->data;
+	return 0;
+}
+
+static u64 jit_nlattr_nest(struct sk_buff *skb, u32 A, u32 X)
+{
+	struct nlattr *nla;
+
+	if (skb_is_nonlinear(skb))
+		return (u64)1 << 32;
+	if (A > skb->len - sizeof(struct nlattr))
+		return (u64)1 << 32;
+
+	nla = (struct nlattr *)&skb->data[A];
+	if (nla->nla_len > A - skb->len)
+		return (u64)1 << 32;
+
+	nla = nla_find_nested(nla, X);
+	if (nla)
+		return (void *)nla - (void *)skb->data;
+	return 0;
+}
+
 /*
  * Wrapper that handles both OABI and EABI and assures Thumb2 interworking
  * (where the assembly routines like __aeabi_uidiv could cause problems).
@@ -169,6 +224,8 @@ static inline bool is_load_to_a(u16 inst)
 	case BPF_S_ANC_PROTOCOL:
 	case BPF_S_ANC_RXHASH:
 	case BPF_S_ANC_QUEUE:
+	case BPF_S_ANC_PKTTYPE:
+	case BPF_S_ANC_HATYPE:
 		return true;
 	default:
 		return false;
@@ -498,9 +555,10 @@ static int build_body(struct jit_ctx *ctx)
 		case BPF_S_LD_B_ABS:
 			load_order = 0;
 load:
-			/* the interpreter will deal with the negative K */
-			if ((int)k < 0)
-				return -ENOTSUPP;
+			/*
+			 * A negative K fails the unsigned bound check below,
+			 * the slowpath then deals with SKF_{NET,LL}_OFF.
+			 */
 			emit_mov_i(r_off, k, ctx);
 load_common:
 			ctx->seen |= SEEN_DATA | SEEN_CALL;
@@ -565,9 +623,6 @@ load_ind:
 		case BPF_S_LDX_B_MSH:
 			/* x = ((*(frame + k)) & 0xf) << 2; */
 			ctx->seen |= SEEN_X | SEEN_DATA | SEEN_CALL;
-			/* the interpreter should deal with the negative K */
-			if (k < 0)
-				return -1;
 			/* offset in r1: we might have to take the slow path */
 			emit_mov_i(r_off, k, ctx);
 			emit(ARM_CMP_R(r_skb_hl, r_off), ctx);
@@ -655,8 +710,12 @@ load_ind:
 			emit(ARM_AND_R(r_A, r_A, r_X), ctx);
 			break;
 		case BPF_S_ALU_LSH_K:
-			if (unlikely(k > 31))
-				return -1;
+			if (unlikely(k > 31)) {
+				/* same result as the interpreter: LSL by reg */
+				emit_mov_i(r_scratch, k, ctx);
+				emit(ARM_LSL_R(r_A, r_A, r_scratch), ctx);
+				break;
+			}
 			emit(ARM_LSL_I(r_A, r_A, k), ctx);
 			break;
 		case BPF_S_ALU_LSH_X:
@@ -664,8 +723,11 @@ load_ind:
 			emit(ARM_LSL_R(r_A, r_A, r_X), ctx);
 			break;
 		case BPF_S_ALU_RSH_K:
-			if (unlikely(k > 31))
-				return -1;
+			if (unlikely(k > 31)) {
+				emit_mov_i(r_scratch, k, ctx);
+				emit(ARM_LSR_R(r_A, r_A, r_scratch), ctx);
+				break;
+			}
 			emit(ARM_LSR_I(r_A, r_A, k), ctx);
 			break;
 		case BPF_S_ALU_RSH_X:
@@ -793,6 +855,60 @@ b_epilogue:
 			off = offsetof(struct net_device, ifindex);
 			emit(ARM_LDR_I(r_A, r_scratch, off), ctx);
 			break;
+		case BPF_S_ANC_HATYPE:
+			/* A = skb->dev->type */
+			ctx->seen |= SEEN_SKB;
+			off = offsetof(struct sk_buff, dev);
+			emit(ARM_LDR_I(r_scratch, r_skb, off), ctx);
+
+			emit(ARM_CMP_I(r_scratch, 0), ctx);
+			emit_err_ret(ARM_COND_EQ, ctx);
+
+			/*
+			 * dev->type is usually beyond the reach of LDRH's
+			 * 8-bit offset: load the word holding it instead.
+			 */
+			BUILD_BUG_ON(FIELD_SIZEOF(struct net_device,
+						  type) != 2);
+			BUILD_BUG_ON(offsetof(struct net_device, type) > 0xfff);
+			off = offsetof(struct net_device, type);
+			emit(ARM_LDR_I(r_A, r_scratch, off & ~3), ctx);
+#ifdef __LITTLE_ENDIAN
+			if (!(off & 2))
+#else
+			if (off & 2)
+#endif
+				emit(ARM_LSL_I(r_A, r_A, 16), ctx);
+			emit(ARM_LSR_I(r_A, r_A, 16), ctx);
+			break;
+		case BPF_S_ANC_PKTTYPE:
+			/* A = skb->pkt_type */
+			ctx->seen |= SEEN_SKB;
+			BUILD_BUG_ON(PKT_TYPE_OFFSET() > 0xfff);
+			off = PKT_TYPE_OFFSET();
+			emit(ARM_LDRB_I(r_A, r_skb, off), ctx);
+			emit(ARM_AND_I(r_A, r_A, PKT_TYPE_MAX), ctx);
+#ifdef __BIG_ENDIAN_BITFIELD
+			emit(ARM_LSR_I(r_A, r_A, 5), ctx);
+#endif
+			break;
+		case BPF_S_ANC_NLATTR:
+		case BPF_S_ANC_NLATTR_NEST:
+			/* A = offset of attribute X, searching from A */
+			update_on_xread(ctx);
+			ctx->seen |= SEEN_SKB | SEEN_CALL;
+			emit(ARM_MOV_R(ARM_R0, r_skb), ctx);
+			emit(ARM_MOV_R(ARM_R1, r_A), ctx);
+			emit(ARM_MOV_R(ARM_R2, r_X), ctx);
+			emit_mov_i(ARM_R3, inst->code == BPF_S_ANC_NLATTR ?
+					   (u32)jit_nlattr :
+					   (u32)jit_nlattr_nest, ctx);
+			emit_blx_r(ARM_R3, ctx);
+			/* the high word of the result flags an error */
+			emit(ARM_CMP_I(ARM_R1, 0), ctx);
+			emit_err_ret(ARM_COND_NE, ctx);
+			emit(ARM_MOV_R(r_A, ARM_R0), ctx);
+			break;
 		case BPF_S_ANC_MARK:
 			ctx->seen |= SEEN_SKB;
 			BUILD_BUG_ON(FIELD_SIZEOF(struct sk_buff, mark) != 4);
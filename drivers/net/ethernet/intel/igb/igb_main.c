@@ -941,6 +941,29 @@ static void igb_configure_msix(struct igb_adapter *adapter)
 	wrfl();
 }
 
+/**
+ * igb_set_rx_queue_irqs - let RFS steer the MSI-X vectors of Rx queues
+ * @adapter: board private structure
+ * @enable: register the vectors, or stop steering before freeing them
+ **/
+static void igb_set_rx_queue_irqs(struct igb_adapter *adapter, bool enable)
+{
+#ifdef CONFIG_RFS_ACCEL
+	int i;
+
+	for (i = 0; i < adapter->num_q_vectors; i++) {
+		struct igb_q_vector *q_vector = adapter->q_vector[i];
+
+		if (!q_vector->rx.ring)
+			continue;
+		netif_set_rx_queue_irq(adapter->netdev,
+				       q_vector->rx.ring->queue_index,
+				       enable ?
+				       adapter->msix_entries[i + 1].vector : 0);
+	}
+#endif
+}
+
 /**
  * igb_request_msix - Initialize MSI-X interrupts
  *
@@ -985,6 +1008,7 @@ static int igb_request_msix(struct igb_adapter *adapter)
 	}
 
 	igb_configure_msix(adapter);
+	igb_set_rx_queue_irqs(adapter, true);
 	return 0;
 out:
 	return err;
@@ -1342,6 +1366,7 @@ static void igb_free_irq(struct igb_adapter *adapter)
 	if (adapter->msix_entries) {
 		int vector = 0, i;
 
+		igb_set_rx_queue_irqs(adapter, false);
 		free_irq(adapter->msix_entries[vector++].vector, adapter);
 
 		for (i = 0; i < adapter->num_q_vectors; i++)
@@ -107,16 +107,29 @@ struct tap_filter {
 	unsigned char	addr[FLT_EXACT_COUNT][ETH_ALEN];
 };
 
+/* Maximum number of queues (file descriptors) of a multiqueue device */
+#define MAX_TAP_QUEUES 16
+
+/* Each file descriptor attached to a device is one queue: it has its own
+ * socket, whose receive queue holds the packets transmitted on that queue
+ * of the net device. */
 struct tun_file {
 	atomic_t count;
 	struct tun_struct *tun;
 	struct net *net;
+	struct socket socket;
+	struct socket_wq wq;
+	struct fasync_struct *fasync;
+	unsigned int flags;
+	u16 queue_index;
 };
 
 struct tun_sock;
 
 struct tun_struct {
-	struct tun_file		*tfile;
+	/* Attached queues, indexed by tx queue.  Changed under the tx lock. */
+	struct tun_file		*tfiles[MAX_TAP_QUEUES];
+	unsigned int		numqueues;
 	unsigned int 		flags;
 	uid_t			owner;
 	gid_t			group;
@@ -125,13 +138,15 @@ struct tun_struct {
 	netdev_features_t	set_features;
 #define TUN_USER_FEATURES (NETIF_F_HW_CSUM|NETIF_F_TSO_ECN|NETIF_F_TSO| \
 			  NETIF_F_TSO6|NETIF_F_UFO)
-	struct fasync_struct	*fasync;
 
 	struct tap_filter       txflt;
+	/* Device socket: carries the security label and keeps the net
+	 * device alive until the last file has let go of it. */
 	struct socket		socket;
 	struct socket_wq	wq;
 
 	int			vnet_hdr_sz;
+	int			sndbuf;
 
 #ifdef TUN_DEBUG
 	int debug;
@@ -141,6 +156,7 @@ struct tun_struct {
 struct tun_sock {
 	struct sock		sk;
 	struct tun_struct	*tun;
+	struct tun_file		*tfile;	/* NULL for the device socket */
 };
 
 static inline struct tun_sock *tun_sk(struct sock *sk)
@@ -148,6 +164,18 @@ static inline struct tun_sock *tun_sk(struct sock *sk)
 	return container_of(sk, struct tun_sock, sk);
 }
 
+/* Keep the number of active queues of the net device in sync with the
+ * number of attached files. */
+static void tun_set_real_num_queues(struct tun_struct *tun)
+{
+	unsigned int n = max(tun->numqueues, 1U);
+
+	if (tun->dev->reg_state != NETREG_REGISTERED)
+		return;
+	netif_set_real_num_tx_queues(tun->dev, n);
+	netif_set_real_num_rx_queues(tun->dev, n);
+}
+
 static int tun_attach(struct tun_struct *tun, struct file *file)
 {
 	struct tun_file *tfile = file->private_data;
@@ -162,13 +190,18 @@ static int tun_attach(struct tun_struct *tun, struct file *file)
 		goto out;
 
 	err = -EBUSY;
-	if (tun->tfile)
+	if (!(tun->flags & TUN_TAP_MQ) && tun->numqueues)
+		goto out;
+
+	err = -E2BIG;
+	if (tun->numqueues == MAX_TAP_QUEUES)
 		goto out;
 
 	err = 0;
 	tfile->tun = tun;
-	tun->tfile = tfile;
-	tun->socket.file = file;
+	tfile->queue_index = tun->numqueues;
+	tun->tfiles[tun->numqueues++] = tfile;
+	tfile->socket.sk->sk_sndbuf = tun->sndbuf;
 	netif_carrier_on(tun->dev);
 	dev_hold(tun->dev);
 	sock_hold(tun->socket.sk);
@@ -176,28 +209,44 @@ static int tun_attach(struct tun_struct *tun, struct file *file)
 
 out:
 	netif_tx_unlock_bh(tun->dev);
+	if (!err)
+		tun_set_real_num_queues(tun);
 	return err;
 }
 
-static void __tun_detach(struct tun_struct *tun)
+static void __tun_detach(struct tun_struct *tun, struct tun_file *tfile)
 {
-	/* Detach from net device */
+	unsigned int index = tfile->queue_index;
+	struct tun_file *last;
+
+	ASSERT_RTNL();
+
+	/* Detach from net device, moving the last queue into the hole */
 	netif_tx_lock_bh(tun->dev);
-	netif_carrier_off(tun->dev);
-	tun->tfile = NULL;
+	last = tun->tfiles[--tun->numqueues];
+	tun->tfiles[index] = last;
+	last->queue_index = index;
+	tun->tfiles[tun->numqueues] = NULL;
+	if (!tun->numqueues)
+		netif_carrier_off(tun->dev);
 	netif_tx_unlock_bh(tun->dev);
 
+	tun_set_real_num_queues(tun);
+	/* The moved queue may have been stopped under its old index */
+	if (tun->numqueues && netif_running(tun->dev))
+		netif_tx_wake_all_queues(tun->dev);
+
 	/* Drop read queue */
-	skb_queue_purge(&tun->socket.sk->sk_receive_queue);
+	skb_queue_purge(&tfile->socket.sk->sk_receive_queue);
 
 	/* Drop the extra count on the net device */
 	dev_put(tun->dev);
 }
 
-static void tun_detach(struct tun_struct *tun)
+static void tun_detach(struct tun_struct *tun, struct tun_file *tfile)
 {
 	rtnl_lock();
-	__tun_detach(tun);
+	__tun_detach(tun, tfile);
 	rtnl_unlock();
 }
 
@@ -211,17 +260,10 @@ static struct tun_struct *__tun_get(struct tun_file *tfile)
 	return tun;
 }
 
-static struct tun_struct *tun_get(struct file *file)
+static void tun_put(struct tun_file *tfile)
 {
-	return __tun_get(file->private_data);
-}
-
-static void tun_put(struct tun_struct *tun)
-{
-	struct tun_file *tfile = tun->tfile;
-
 	if (atomic_dec_and_test(&tfile->count))
-		tun_detach(tfile->tun);
+		tun_detach(tfile->tun, tfile);
 }
 
 /* TAP filtering */
@@ -342,14 +384,17 @@ static const struct ethtool_ops tun_ethtool_ops;
 static void tun_net_uninit(struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
-	struct tun_file *tfile = tun->tfile;
+	int i;
 
 	/* Inform the methods they need to stop using the dev.
+	 * Walk backwards, since detaching moves the last queue.
 	 */
-	if (tfile) {
-		wake_up_all(&tun->wq.wait);
+	for (i = tun->numqueues - 1; i >= 0; i--) {
+		struct tun_file *tfile = tun->tfiles[i];
+
+		wake_up_all(&tfile->wq.wait);
 		if (atomic_dec_and_test(&tfile->count))
-			__tun_detach(tun);
+			__tun_detach(tun, tfile);
 	}
 }
 
@@ -365,27 +410,44 @@ static void tun_free_netdev(struct net_device *dev)
 /* Net device open. */
 static int tun_net_open(struct net_device *dev)
 {
-	netif_start_queue(dev);
+	netif_tx_start_all_queues(dev);
 	return 0;
 }
 
 /* Net device close. */
 static int tun_net_close(struct net_device *dev)
 {
-	netif_stop_queue(dev);
+	netif_tx_stop_all_queues(dev);
 	return 0;
 }
 
+/* Spread flows over the attached queues by their hash, so that all
+ * packets of a flow are read from the same file descriptor. */
+static u16 tun_select_queue(struct net_device *dev, struct sk_buff *skb)
+{
+	struct tun_struct *tun = netdev_priv(dev);
+	unsigned int numqueues = ACCESS_ONCE(tun->numqueues);
+
+	if (numqueues <= 1)
+		return 0;
+	return ((u64)skb_get_rxhash(skb) * numqueues) >> 32;
+}
+
 /* Net device start xmit */
 static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct tun_struct *tun = netdev_priv(dev);
+	u16 txq = skb_get_queue_mapping(skb);
+	struct tun_file *tfile;
+	struct sock *sk;
 
 	tun_debug(KERN_INFO, tun, "tun_net_xmit %d\n", skb->len);
 
 	/* Drop packet if interface is not attached */
-	if (!tun->tfile)
+	if (txq >= tun->numqueues)
 		goto drop;
+	tfile = tun->tfiles[txq];
+	sk = tfile->socket.sk;
 
 	/* Drop if the filter does not like it.
 	 * This is a noop if the filter is disabled.
@@ -393,15 +455,14 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	if (!check_filter(&tun->txflt, skb))
 		goto drop;
 
-	if (tun->socket.sk->sk_filter &&
-	    sk_filter(tun->socket.sk, skb))
+	if (sk->sk_filter && sk_filter(sk, skb))
 		goto drop;
 
-	if (skb_queue_len(&tun->socket.sk->sk_receive_queue) >= dev->tx_queue_len) {
+	if (skb_queue_len(&sk->sk_receive_queue) >= dev->tx_queue_len) {
 		if (!(tun->flags & TUN_ONE_QUEUE)) {
 			/* Normal queueing mode. */
 			/* Packet scheduler handles dropping of further packets. */
-			netif_stop_queue(dev);
+			netif_stop_subqueue(dev, txq);
 
 			/* We won't see all dropped packets individually, so overrun
 			 * error is more appropriate. */
@@ -418,12 +479,12 @@ static netdev_tx_t tun_net_xmit(struct sk_buff *skb, struct net_device *dev)
 	skb_orphan(skb);
 
 	/* Enqueue packet */
-	skb_queue_tail(&tun->socket.sk->sk_receive_queue, skb);
+	skb_queue_tail(&sk->sk_receive_queue, skb);
 
 	/* Notify and wake up reader process */
-	if (tun->flags & TUN_FASYNC)
-		kill_fasync(&tun->fasync, SIGIO, POLL_IN);
-	wake_up_interruptible_poll(&tun->wq.wait, POLLIN |
+	if (tfile->flags & TUN_FASYNC)
+		kill_fasync(&tfile->fasync, SIGIO, POLL_IN);
+	wake_up_interruptible_poll(&tfile->wq.wait, POLLIN |
 				   POLLRDNORM | POLLRDBAND);
 	return NETDEV_TX_OK;
 
@@ -483,6 +544,7 @@ static const struct net_device_ops tun_netdev_ops = {
 	.ndo_open		= tun_net_open,
 	.ndo_stop		= tun_net_close,
 	.ndo_start_xmit		= tun_net_xmit,
+	.ndo_select_queue	= tun_select_queue,
 	.ndo_change_mtu		= tun_net_change_mtu,
 	.ndo_fix_features	= tun_net_fix_features,
 #ifdef CONFIG_NET_POLL_CONTROLLER
@@ -495,6 +557,7 @@ static const struct net_device_ops tap_netdev_ops = {
 	.ndo_open		= tun_net_open,
 	.ndo_stop		= tun_net_close,
 	.ndo_start_xmit		= tun_net_xmit,
+	.ndo_select_queue	= tun_select_queue,
 	.ndo_change_mtu		= tun_net_change_mtu,
 	.ndo_fix_features	= tun_net_fix_features,
 	.ndo_set_rx_mode	= tun_net_mclist,
@@ -551,11 +614,11 @@ static unsigned int tun_chr_poll(struct file *file, poll_table * wait)
 	if (!tun)
 		return POLLERR;
 
-	sk = tun->socket.sk;
+	sk = tfile->socket.sk;
 
 	tun_debug(KERN_INFO, tun, "tun_chr_poll\n");
 
-	poll_wait(file, &tun->wq.wait, wait);
+	poll_wait(file, &tfile->wq.wait, wait);
 
 	if (!skb_queue_empty(&sk->sk_receive_queue))
 		mask |= POLLIN | POLLRDNORM;
@@ -568,17 +631,17 @@ static unsigned int tun_chr_poll(struct file *file, poll_table * wait)
 	if (tun->dev->reg_state != NETREG_REGISTERED)
 		mask = POLLERR;
 
-	tun_put(tun);
+	tun_put(tfile);
 	return mask;
 }
 
 /* prepad is the amount to reserve at front.  len is length after that.
  * linear is a hint as to how much to copy (usually headers). */
-static struct sk_buff *tun_alloc_skb(struct tun_struct *tun,
+static struct sk_buff *tun_alloc_skb(struct tun_file *tfile,
 				     size_t prepad, size_t len,
 				     size_t linear, int noblock)
 {
-	struct sock *sk = tun->socket.sk;
+	struct sock *sk = tfile->socket.sk;
 	struct sk_buff *skb;
 	int err;
 
@@ -602,7 +665,7 @@ static struct sk_buff *tun_alloc_skb(struct tun_struct *tun,
 }
 
 /* Get packet from user space buffer */
-static ssize_t tun_get_user(struct tun_struct *tun,
+static ssize_t tun_get_user(struct tun_struct *tun, struct tun_file *tfile,
 			    const struct iovec *iv, size_t count,
 			    int noblock)
 {
@@ -644,7 +707,7 @@ static ssize_t tun_get_user(struct tun_struct *tun,
 			return -EINVAL;
 	}
 
-	skb = tun_alloc_skb(tun, align, len, gso.hdr_len, noblock);
+	skb = tun_alloc_skb(tfile, align, len, gso.hdr_len, noblock);
 	if (IS_ERR(skb)) {
 		if (PTR_ERR(skb) != -EAGAIN)
 			tun->dev->stats.rx_dropped++;
@@ -725,6 +788,7 @@ static ssize_t tun_get_user(struct tun_struct *tun,
 		skb_shinfo(skb)->gso_segs = 0;
 	}
 
+	skb_record_rx_queue(skb, tfile->queue_index);
 	netif_rx_ni(skb);
 
 	tun->dev->stats.rx_packets++;
@@ -737,7 +801,8 @@ static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
 			      unsigned long count, loff_t pos)
 {
 	struct file *file = iocb->ki_filp;
-	struct tun_struct *tun = tun_get(file);
+	struct tun_file *tfile = file->private_data;
+	struct tun_struct *tun = __tun_get(tfile);
 	ssize_t result;
 
 	if (!tun)
@@ -745,10 +810,10 @@ static ssize_t tun_chr_aio_write(struct kiocb *iocb, const struct iovec *iv,
 
 	tun_debug(KERN_INFO, tun, "tun_chr_write %ld\n", count);
 
-	result = tun_get_user(tun, iv, iov_length(iv, count),
+	result = tun_get_user(tun, tfile, iv, iov_length(iv, count),
 			      file->f_flags & O_NONBLOCK);
 
-	tun_put(tun);
+	tun_put(tfile);
 	return result;
 }
 
@@ -833,7 +898,7 @@ static ssize_t tun_put_user(struct tun_struct *tun,
 	return total;
 }
 
-static ssize_t tun_do_read(struct tun_struct *tun,
+static ssize_t tun_do_read(struct tun_struct *tun, struct tun_file *tfile,
 			   struct kiocb *iocb, const struct iovec *iv,
 			   ssize_t len, int noblock)
 {
@@ -844,12 +909,12 @@ static ssize_t tun_do_read(struct tun_struct *tun,
 	tun_debug(KERN_INFO, tun, "tun_chr_read\n");
 
 	if (unlikely(!noblock))
-		add_wait_queue(&tun->wq.wait, &wait);
+		add_wait_queue(&tfile->wq.wait, &wait);
 	while (len) {
 		current->state = TASK_INTERRUPTIBLE;
 
 		/* Read frames from the queue */
-		if (!(skb=skb_dequeue(&tun->socket.sk->sk_receive_queue))) {
+		if (!(skb=skb_dequeue(&tfile->socket.sk->sk_receive_queue))) {
 			if (noblock) {
 				ret = -EAGAIN;
 				break;
@@ -867,7 +932,7 @@ static ssize_t tun_do_read(struct tun_struct *tun,
 			schedule();
 			continue;
 		}
-		netif_wake_queue(tun->dev);
+		netif_wake_subqueue(tun->dev, tfile->queue_index);
 
 		ret = tun_put_user(tun, skb, iv, len);
 		kfree_skb(skb);
@@ -876,7 +941,7 @@ static ssize_t tun_do_read(struct tun_struct *tun,
 
 	current->state = TASK_RUNNING;
 	if (unlikely(!noblock))
-		remove_wait_queue(&tun->wq.wait, &wait);
+		remove_wait_queue(&tfile->wq.wait, &wait);
 
 	return ret;
 }
@@ -897,10 +962,11 @@ static ssize_t tun_chr_aio_read(struct kiocb *iocb, const struct iovec *iv,
 		goto out;
 	}
 
-	ret = tun_do_read(tun, iocb, iv, len, file->f_flags & O_NONBLOCK);
+	ret = tun_do_read(tun, tfile, iocb, iv, len,
+			  file->f_flags & O_NONBLOCK);
 	ret = min_t(ssize_t, ret, len);
 out:
-	tun_put(tun);
+	tun_put(tfile);
 	return ret;
 }
 
@@ -932,7 +998,7 @@ static struct rtnl_link_ops tun_link_ops __read_mostly = {
 
 static void tun_sock_write_space(struct sock *sk)
 {
-	struct tun_struct *tun;
+	struct tun_file *tfile;
 	wait_queue_head_t *wqueue;
 
 	if (!sock_writeable(sk))
@@ -946,8 +1012,9 @@ static void tun_sock_write_space(struct sock *sk)
 		wake_up_interruptible_sync_poll(wqueue, POLLOUT |
 						POLLWRNORM | POLLWRBAND);
 
-	tun = tun_sk(sk)->tun;
-	kill_fasync(&tun->fasync, SIGIO, POLL_OUT);
+	tfile = tun_sk(sk)->tfile;
+	if (tfile)
+		kill_fasync(&tfile->fasync, SIGIO, POLL_OUT);
 }
 
 static void tun_sock_destruct(struct sock *sk)
@@ -955,28 +1022,50 @@ static void tun_sock_destruct(struct sock *sk)
 	free_netdev(tun_sk(sk)->tun->dev);
 }
 
+/* skbs charged to the socket of a file may outlive the file itself, in a
+ * qdisc or a driver ring: tun_sock_write_space() then still looks at the
+ * socket and wait queue embedded in the tun_file, so only free it along
+ * with the sock. */
+static void tun_file_sock_destruct(struct sock *sk)
+{
+	kfree(tun_sk(sk)->tfile);
+}
+
 static int tun_sendmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *m, size_t total_len)
 {
-	struct tun_struct *tun = container_of(sock, struct tun_struct, socket);
-	return tun_get_user(tun, m->msg_iov, total_len,
-			    m->msg_flags & MSG_DONTWAIT);
+	struct tun_file *tfile = container_of(sock, struct tun_file, socket);
+	struct tun_struct *tun = __tun_get(tfile);
+	int ret;
+
+	if (!tun)
+		return -EBADFD;
+	ret = tun_get_user(tun, tfile, m->msg_iov, total_len,
+			   m->msg_flags & MSG_DONTWAIT);
+	tun_put(tfile);
+	return ret;
 }
 
 static int tun_recvmsg(struct kiocb *iocb, struct socket *sock,
 		       struct msghdr *m, size_t total_len,
 		       int flags)
 {
-	struct tun_struct *tun = container_of(sock, struct tun_struct, socket);
+	struct tun_file *tfile = container_of(sock, struct tun_file, socket);
+	struct tun_struct *tun;
 	int ret;
+
 	if (flags & ~(MSG_DONTWAIT|MSG_TRUNC))
 		return -EINVAL;
-	ret = tun_do_read(tun, iocb, m->msg_iov, total_len,
+	tun = __tun_get(tfile);
+	if (!tun)
+		return -EBADFD;
+	ret = tun_do_read(tun, tfile, iocb, m->msg_iov, total_len,
 			  flags & MSG_DONTWAIT);
 	if (ret > total_len) {
 		m->msg_flags |= MSG_TRUNC;
 		ret = flags & MSG_TRUNC ? ret : total_len;
 	}
+	tun_put(tfile);
 	return ret;
 }
 
@@ -1018,6 +1107,9 @@ static int tun_flags(struct tun_struct *tun)
 	if (tun->flags & TUN_VNET_HDR)
 		flags |= IFF_VNET_HDR;
 
+	if (tun->flags & TUN_TAP_MQ)
+		flags |= IFF_MULTI_QUEUE;
+
 	return flags;
 }
 
@@ -1066,6 +1158,10 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		else
 			return -EINVAL;
 
+		if (!!(ifr->ifr_flags & IFF_MULTI_QUEUE) !=
+		    !!(tun->flags & TUN_TAP_MQ))
+			return -EINVAL;
+
 		if (((tun->owner != -1 && cred->euid != tun->owner) ||
 		     (tun->group != -1 && !in_egroup_p(tun->group))) &&
 		    !capable(CAP_NET_ADMIN))
@@ -1100,11 +1196,15 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		} else
 			return -EINVAL;
 
+		if (ifr->ifr_flags & IFF_MULTI_QUEUE)
+			flags |= TUN_TAP_MQ;
+
 		if (*ifr->ifr_name)
 			name = ifr->ifr_name;
 
-		dev = alloc_netdev(sizeof(struct tun_struct), name,
-				   tun_setup);
+		dev = alloc_netdev_mqs(sizeof(struct tun_struct), name,
+				       tun_setup, MAX_TAP_QUEUES,
+				       MAX_TAP_QUEUES);
 		if (!dev)
 			return -ENOMEM;
 
@@ -1116,6 +1216,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 		tun->flags = flags;
 		tun->txflt.count = 0;
 		tun->vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+		tun->sndbuf = INT_MAX;
 		set_bit(SOCK_EXTERNALLY_ALLOCATED, &tun->socket.flags);
 
 		err = -ENOMEM;
@@ -1178,7 +1279,7 @@ static int tun_set_iff(struct net *net, struct file *file, struct ifreq *ifr)
 	 * xoff state.
 	 */
 	if (netif_running(tun->dev))
-		netif_wake_queue(tun->dev);
+		netif_tx_wake_all_queues(tun->dev);
 
 	strcpy(ifr->ifr_name, tun->dev->name);
 	return 0;
@@ -1253,6 +1354,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 	int sndbuf;
 	int vnet_hdr_sz;
 	int ret;
+	int i;
 
 	if (cmd == TUNSETIFF || _IOC_TYPE(cmd) == 0x89) {
 		if (copy_from_user(&ifr, argp, ifreq_len))
@@ -1265,7 +1367,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		 * This is needed because we never checked for invalid flags on
 		 * TUNSETIFF. */
 		return put_user(IFF_TUN | IFF_TAP | IFF_NO_PI | IFF_ONE_QUEUE |
-				IFF_VNET_HDR,
+				IFF_VNET_HDR | IFF_MULTI_QUEUE,
 				(unsigned int __user*)argp);
 	}
 
@@ -1383,7 +1485,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		break;
 
 	case TUNGETSNDBUF:
-		sndbuf = tun->socket.sk->sk_sndbuf;
+		sndbuf = tun->sndbuf;
 		if (copy_to_user(argp, &sndbuf, sizeof(sndbuf)))
 			ret = -EFAULT;
 		break;
@@ -1394,7 +1496,11 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 			break;
 		}
 
-		tun->socket.sk->sk_sndbuf = sndbuf;
+		/* The send buffer is a property of the device: apply it
+		 * to every attached queue. */
+		tun->sndbuf = sndbuf;
+		for (i = 0; i < tun->numqueues; i++)
+			tun->tfiles[i]->socket.sk->sk_sndbuf = sndbuf;
 		break;
 
 	case TUNGETVNETHDRSZ:
@@ -1425,7 +1531,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		if (copy_from_user(&fprog, argp, sizeof(fprog)))
 			break;
 
-		ret = sk_attach_filter(&fprog, tun->socket.sk);
+		ret = sk_attach_filter(&fprog, tfile->socket.sk);
 		break;
 
 	case TUNDETACHFILTER:
@@ -1433,7 +1539,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 		ret = -EINVAL;
 		if ((tun->flags & TUN_TYPE_MASK) != TUN_TAP_DEV)
 			break;
-		ret = sk_detach_filter(tun->socket.sk);
+		ret = sk_detach_filter(tfile->socket.sk);
 		break;
 
 	default:
@@ -1444,7 +1550,7 @@ static long __tun_chr_ioctl(struct file *file, unsigned int cmd,
 unlock:
 	rtnl_unlock();
 	if (tun)
-		tun_put(tun);
+		tun_put(tfile);
 	return ret;
 }
 
@@ -1485,7 +1591,8 @@ static long tun_chr_compat_ioctl(struct file *file,
 
 static int tun_chr_fasync(int fd, struct file *file, int on)
 {
-	struct tun_struct *tun = tun_get(file);
+	struct tun_file *tfile = file->private_data;
+	struct tun_struct *tun = __tun_get(tfile);
 	int ret;
 
 	if (!tun)
@@ -1493,34 +1600,56 @@ static int tun_chr_fasync(int fd, struct file *file, int on)
 
 	tun_debug(KERN_INFO, tun, "tun_chr_fasync %d\n", on);
 
-	if ((ret = fasync_helper(fd, file, on, &tun->fasync)) < 0)
+	if ((ret = fasync_helper(fd, file, on, &tfile->fasync)) < 0)
 		goto out;
 
 	if (on) {
 		ret = __f_setown(file, task_pid(current), PIDTYPE_PID, 0);
 		if (ret)
 			goto out;
-		tun->flags |= TUN_FASYNC;
+		tfile->flags |= TUN_FASYNC;
 	} else
-		tun->flags &= ~TUN_FASYNC;
+		tfile->flags &= ~TUN_FASYNC;
 	ret = 0;
 out:
-	tun_put(tun);
+	tun_put(tfile);
 	return ret;
 }
 
 static int tun_chr_open(struct inode *inode, struct file * file)
 {
 	struct tun_file *tfile;
+	struct sock *sk;
 
 	DBG1(KERN_INFO, "tunX: tun_chr_open\n");
 
-	tfile = kmalloc(sizeof(*tfile), GFP_KERNEL);
+	tfile = kzalloc(sizeof(*tfile), GFP_KERNEL);
 	if (!tfile)
 		return -ENOMEM;
 	atomic_set(&tfile->count, 0);
 	tfile->tun = NULL;
 	tfile->net = get_net(current->nsproxy->net_ns);
+
+	sk = sk_alloc(&init_net, AF_UNSPEC, GFP_KERNEL, &tun_proto);
+	if (!sk) {
+		put_net(tfile->net);
+		kfree(tfile);
+		return -ENOMEM;
+	}
+
+	sk_change_net(sk, tfile->net);
+	set_bit(SOCK_EXTERNALLY_ALLOCATED, &tfile->socket.flags);
+	tfile->socket.wq = &tfile->wq;
+	init_waitqueue_head(&tfile->wq.wait);
+	tfile->socket.file = file;
+	tfile->socket.ops = &tun_socket_ops;
+	sock_init_data(&tfile->socket, sk);
+	sk->sk_write_space = tun_sock_write_space;
+	sk->sk_destruct = tun_file_sock_destruct;
+	sk->sk_sndbuf = INT_MAX;
+
+	tun_sk(sk)->tfile = tfile;
+
 	file->private_data = tfile;
 	return 0;
 }
@@ -1529,30 +1658,33 @@ static int tun_chr_close(struct inode *inode, struct file *file)
 {
 	struct tun_file *tfile = file->private_data;
 	struct tun_struct *tun;
+	struct net *net;
 
+	rtnl_lock();
 	tun = __tun_get(tfile);
 	if (tun) {
 		struct net_device *dev = tun->dev;
 
 		tun_debug(KERN_INFO, tun, "tun_chr_close\n");
 
-		__tun_detach(tun);
+		__tun_detach(tun, tfile);
 
-		/* If desirable, unregister the netdevice. */
-		if (!(tun->flags & TUN_PERSIST)) {
-			rtnl_lock();
-			if (dev->reg_state == NETREG_REGISTERED)
-				unregister_netdevice(dev);
-			rtnl_unlock();
-		}
+		/* If desirable, unregister the netdevice once the last
+		 * queue is gone. */
+		if (!(tun->flags & TUN_PERSIST) && !tun->numqueues &&
+		    dev->reg_state == NETREG_REGISTERED)
+			unregister_netdevice(dev);
 	}
+	rtnl_unlock();
 
 	tun = tfile->tun;
 	if (tun)
 		sock_put(tun->socket.sk);
 
-	put_net(tfile->net);
-	kfree(tfile);
+	/* The last reference to the sock frees tfile */
+	net = tfile->net;
+	sk_release_kernel(tfile->socket.sk);
+	put_net(net);
 
 	return 0;
 }
@@ -1679,14 +1811,16 @@ static void tun_cleanup(void)
  * holding a reference to the file for as long as the socket is in use. */
 struct socket *tun_get_socket(struct file *file)
 {
+	struct tun_file *tfile;
 	struct tun_struct *tun;
 	if (file->f_op != &tun_fops)
 		return ERR_PTR(-EINVAL);
-	tun = tun_get(file);
+	tfile = file->private_data;
+	tun = __tun_get(tfile);
 	if (!tun)
 		return ERR_PTR(-EBADFD);
-	tun_put(tun);
-	return &tun->socket;
+	tun_put(tfile);
+	return &tfile->socket;
 }
 EXPORT_SYMBOL_GPL(tun_get_socket);
 
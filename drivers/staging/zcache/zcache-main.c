@@ -43,6 +43,10 @@
 #endif
 #ifdef CONFIG_FRONTSWAP
 #include <linux/frontswap.h>
+#include <linux/swapops.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
 #endif
 
 #if 0
@@ -689,6 +693,17 @@ static unsigned int zv_max_zsize = (PAGE_SIZE / 8) * 7;
  * driving the mean below this threshold
  */
 static unsigned int zv_max_mean_zsize = (PAGE_SIZE / 8) * 5;
+/*
+ * once the number of persistent pages exceeds this percentage of the
+ * zv_page_count_policy_percent limit, the oldest ones are written back
+ * to the swap device to make room for new ones; 0 disables writeback
+ */
+static unsigned int zv_writeback_percent = 90;
+
+static inline unsigned long zv_page_count_limit(void)
+{
+	return (zv_page_count_policy_percent * totalram_pages) / 100;
+}
 
 static atomic_t zv_curr_dist_counts[NCHUNKS];
 static atomic_t zv_cumul_dist_counts[NCHUNKS];
@@ -895,6 +910,37 @@ static ssize_t zv_page_count_policy_percent_store(struct kobject *kobj,
 	return count;
 }
 
+/*
+ * setting zv_writeback_percent via sysfs sets the fill level, relative to
+ * the zv_page_count_policy_percent limit, at which the oldest persistent
+ * pages start being written back to the swap device.  Writeback continues
+ * until the pool is 1/16th below that level.  Zero disables writeback, so
+ * puts are simply rejected once the limit is reached.
+ */
+static ssize_t zv_writeback_percent_show(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 char *buf)
+{
+	return sprintf(buf, "%u\n", zv_writeback_percent);
+}
+
+static ssize_t zv_writeback_percent_store(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  const char *buf, size_t count)
+{
+	unsigned long val;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	err = kstrtoul(buf, 10, &val);
+	if (err || (val > 100))
+		return -EINVAL;
+	zv_writeback_percent = val;
+	return count;
+}
+
 static struct kobj_attribute zcache_zv_max_zsize_attr = {
 		.attr = { .name = "zv_max_zsize", .mode = 0644 },
 		.show = zv_max_zsize_show,
@@ -913,6 +959,12 @@ static struct kobj_attribute zcache_zv_page_count_policy_percent_attr = {
 		.show = zv_page_count_policy_percent_show,
 		.store = zv_page_count_policy_percent_store,
 };
+
+static struct kobj_attribute zcache_zv_writeback_percent_attr = {
+		.attr = { .name = "zv_writeback_percent", .mode = 0644 },
+		.show = zv_writeback_percent_show,
+		.store = zv_writeback_percent_store,
+};
 #endif
 
 /*
@@ -926,6 +978,7 @@ static unsigned long zcache_flobj_total;
 static unsigned long zcache_flobj_found;
 static unsigned long zcache_failed_eph_puts;
 static unsigned long zcache_failed_pers_puts;
+static unsigned long zcache_writeback_pages;
 
 /*
  * Tmem operations assume the poolid implies the invoking client.
@@ -1203,8 +1256,7 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 	} else {
 		curr_pers_pampd_count =
 			atomic_read(&zcache_curr_pers_pampd_count);
-		if (curr_pers_pampd_count >
-		    (zv_page_count_policy_percent * totalram_pages) / 100)
+		if (curr_pers_pampd_count > zv_page_count_limit())
 			goto out;
 		ret = zcache_compress(page, &cdata, &clen);
 		if (ret == 0)
@@ -1469,6 +1521,7 @@ ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
 ZCACHE_SYSFS_RO(compress_poor);
 ZCACHE_SYSFS_RO(mean_compress_poor);
+ZCACHE_SYSFS_RO(writeback_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
 ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
@@ -1515,6 +1568,8 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_zv_max_zsize_attr.attr,
 	&zcache_zv_max_mean_zsize_attr.attr,
 	&zcache_zv_page_count_policy_percent_attr.attr,
+	&zcache_zv_writeback_percent_attr.attr,
+	&zcache_writeback_pages_attr.attr,
 	NULL,
 };
 
@@ -1849,6 +1904,93 @@ static inline struct tmem_oid oswiz(unsigned type, u32 ind)
 	return oid;
 }
 
+/*
+ * Writeback of cold frontswap pages.  Every successful put is logged, in
+ * order, in a ring of swap entries.  When the persistent pool grows past
+ * zv_writeback_percent of its limit, a work item takes the oldest entries
+ * off the ring and has frontswap write those pages to the swap device.
+ * Entries may have gone stale (invalidated or swapped in since), which
+ * frontswap_writeback_page() detects.  A full ring drops its oldest entry
+ * to make room, so new puts always remain candidates for writeback.
+ */
+static swp_entry_t *zcache_wb_ring;
+static unsigned long zcache_wb_ring_size;	/* power of two */
+static unsigned long zcache_wb_head, zcache_wb_tail;
+static DEFINE_SPINLOCK(zcache_wb_lock);
+
+static void zcache_writeback_work(struct work_struct *work);
+static DECLARE_WORK(zcache_wb_work, zcache_writeback_work);
+
+static int __init zcache_wb_init(void)
+{
+	zcache_wb_ring_size = roundup_pow_of_two(max(totalram_pages / 8,
+						     1024UL));
+	zcache_wb_ring = vmalloc(zcache_wb_ring_size * sizeof(swp_entry_t));
+	if (zcache_wb_ring == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+/* called with interrupts disabled */
+static void zcache_wb_log(unsigned type, pgoff_t offset)
+{
+	if (zcache_wb_ring == NULL)
+		return;
+	spin_lock(&zcache_wb_lock);
+	if (zcache_wb_head - zcache_wb_tail == zcache_wb_ring_size)
+		zcache_wb_tail++;
+	zcache_wb_ring[zcache_wb_head++ & (zcache_wb_ring_size - 1)] =
+		swp_entry(type, offset);
+	spin_unlock(&zcache_wb_lock);
+}
+
+static bool zcache_wb_pop(swp_entry_t *entry)
+{
+	bool ret = false;
+
+	spin_lock_irq(&zcache_wb_lock);
+	if (zcache_wb_head != zcache_wb_tail) {
+		*entry = zcache_wb_ring[zcache_wb_tail++ &
+					(zcache_wb_ring_size - 1)];
+		ret = true;
+	}
+	spin_unlock_irq(&zcache_wb_lock);
+	return ret;
+}
+
+static unsigned long zcache_wb_threshold(void)
+{
+	return zv_page_count_limit() / 100 * zv_writeback_percent;
+}
+
+static void zcache_writeback_work(struct work_struct *work)
+{
+	unsigned long target = zcache_wb_threshold();
+	swp_entry_t entry;
+	int ret;
+
+	/* go a little below the threshold so that we don't hover on it */
+	target -= target >> 4;
+	while (atomic_read(&zcache_curr_pers_pampd_count) > target &&
+	       zcache_wb_pop(&entry)) {
+		ret = frontswap_writeback_page(swp_type(entry),
+					       swp_offset(entry));
+		if (ret == 0)
+			zcache_writeback_pages++;
+		else if (ret == -ENOMEM)
+			break;
+		cond_resched();
+	}
+}
+
+static void zcache_wb_kick(void)
+{
+	if (zv_writeback_percent == 0 || zcache_wb_ring == NULL)
+		return;
+	if (atomic_read(&zcache_curr_pers_pampd_count) > zcache_wb_threshold())
+		schedule_work(&zcache_wb_work);
+}
+
 static int zcache_frontswap_put_page(unsigned type, pgoff_t offset,
 				   struct page *page)
 {
@@ -1863,7 +2005,10 @@ static int zcache_frontswap_put_page(unsigned type, pgoff_t offset,
 		local_irq_save(flags);
 		ret = zcache_put_page(LOCAL_CLIENT, zcache_frontswap_poolid,
 					&oid, iswiz(ind), page);
+		if (ret == 0)
+			zcache_wb_log(type, offset);
 		local_irq_restore(flags);
+		zcache_wb_kick();
 	}
 	return ret;
 }
@@ -2073,6 +2218,9 @@ static int __init zcache_init(void)
 		old_ops = zcache_frontswap_register_ops();
 		pr_info("zcache: frontswap enabled using kernel "
 			"transcendent memory and zsmalloc\n");
+		if (zcache_wb_init())
+			pr_warning("zcache: no memory for writeback, "
+				   "frontswap pages will stay in RAM\n");
 		if (old_ops.init != NULL)
 			pr_warning("zcache: frontswap_ops overridden");
 	}
@@ -22,11 +22,13 @@
 #include <linux/init.h>
 #include <linux/string.h>
 #include <linux/slab.h>
-#include <asm/tlbflush.h>
-#include <asm/pgtable.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
 #include <linux/cpumask.h>
 #include <linux/cpu.h>
-#include <linux/vmalloc.h>
+#include <linux/bit_spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "zsmalloc.h"
 #include "zsmalloc_int.h"
@@ -40,9 +42,14 @@
 #define CLASS_IDX_MASK	((1 << CLASS_IDX_BITS) - 1)
 #define FULLNESS_MASK	((1 << FULLNESS_BITS) - 1)
 
-/* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
+/* per-cpu buffers for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* handles, i.e. the words holding each object's current location */
+static struct kmem_cache *zs_handle_cachep;
+
+static struct dentry *zs_stat_root;
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -122,6 +129,7 @@ static void insert_zspage(struct page *page, struct size_class *class,
 		list_add_tail(&page->lru, &(*head)->lru);
 
 	*head = page;
+	class->fullness_count[fullness]++;
 }
 
 static void remove_zspage(struct page *page, struct size_class *class,
@@ -143,6 +151,7 @@ static void remove_zspage(struct page *page, struct size_class *class,
 					struct page, lru);
 
 	list_del_init(&page->lru);
+	class->fullness_count[fullness]--;
 }
 
 static enum fullness_group fix_fullness_group(struct zs_pool *pool,
@@ -230,30 +239,59 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single object location value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
 
-	return (void *)handle;
+	return obj;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given object location */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle >> OBJ_TAG_BITS;
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+/*
+ * Point @handle at location @obj. Compaction rewrites the handle of an
+ * object it moves while holding the pin bit, so it passes @pinned to
+ * keep the bit set until it calls unpin_tag().
+ */
+static void record_obj(unsigned long handle, unsigned long obj, int pinned)
+{
+	*(unsigned long *)handle = (obj << OBJ_TAG_BITS) |
+				((unsigned long)!!pinned << HANDLE_PIN_BIT);
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +368,8 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i) <<
+						OBJ_TAG_BITS;
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +380,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0) << OBJ_TAG_BITS;
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,9 +435,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -425,6 +464,388 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/*
+ * Take the first free object of zspage @first_page, record @handle in it
+ * and return its location. Called with class->lock held.
+ */
+static unsigned long obj_malloc(struct size_class *class,
+				struct page *first_page, unsigned long handle)
+{
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long obj, m_objidx, m_offset;
+	void *vaddr;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)vaddr + m_offset / sizeof(*link);
+	first_page->freelist = (void *)(link->next >> OBJ_TAG_BITS);
+	link->handle = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(vaddr);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj;
+}
+
+/* Return object @obj to its zspage's freelist. Called with class->lock held */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	vaddr = kmap_atomic(f_page);
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = (unsigned long)first_page->freelist << OBJ_TAG_BITS;
+	kunmap_atomic(vaddr);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
+/*
+ * Find the sub-page, obj_idx and offset of the object numbered @nr
+ * (counting from 0 across the whole zspage) in zspage @first_page.
+ */
+static void obj_nr_to_location(struct size_class *class,
+				struct page *first_page, unsigned long nr,
+				struct page **page, unsigned long *obj_idx,
+				unsigned long *offset)
+{
+	unsigned long off = nr * class->size;
+	unsigned long page_nr = off >> PAGE_SHIFT;
+	struct page *p = first_page;
+	unsigned long i;
+
+	for (i = 0; i < page_nr; i++)
+		p = get_next_page(p);
+
+	*page = p;
+	*obj_idx = nr - DIV_ROUND_UP(page_nr << PAGE_SHIFT, class->size);
+	*offset = off & ~PAGE_MASK;
+}
+
+/*
+ * Starting from object number *@nr, find the next allocated object of
+ * zspage @first_page. Returns its handle and sets @obj to its location,
+ * or returns 0 if there is none. *@nr is advanced past the object.
+ */
+static unsigned long find_alloced_obj(struct size_class *class,
+				struct page *first_page, unsigned long *nr,
+				unsigned long *obj)
+{
+	struct link_free *link;
+	struct page *page;
+	unsigned long obj_idx, off, handle = 0;
+	void *vaddr;
+
+	while (!handle && *nr < first_page->objects) {
+		obj_nr_to_location(class, first_page, *nr, &page, &obj_idx,
+					&off);
+		vaddr = kmap_atomic(page);
+		link = (struct link_free *)(vaddr + off);
+		if (link->handle & OBJ_ALLOCATED_TAG) {
+			handle = link->handle & ~OBJ_ALLOCATED_TAG;
+			*obj = location_to_obj(page, obj_idx);
+		}
+		kunmap_atomic(vaddr);
+		(*nr)++;
+	}
+
+	return handle;
+}
+
+/* Copy the contents of object @src to object @dst; both may span pages */
+static void zs_object_copy(struct size_class *class, unsigned long dst,
+				unsigned long src)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_idx, d_idx, s_off, d_off;
+	void *s_addr, *d_addr;
+	int size = class->size;
+	int len;
+
+	obj_to_location(src, &s_page, &s_idx);
+	obj_to_location(dst, &d_page, &d_idx);
+	s_off = obj_idx_to_offset(s_page, s_idx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_idx, class->size);
+
+	while (size) {
+		len = min_t(int, size, PAGE_SIZE - s_off);
+		len = min_t(int, len, PAGE_SIZE - d_off);
+
+		s_addr = kmap_atomic(s_page);
+		d_addr = kmap_atomic(d_page);
+		memcpy(d_addr + d_off, s_addr + s_off, len);
+		kunmap_atomic(d_addr);
+		kunmap_atomic(s_addr);
+
+		size -= len;
+		s_off += len;
+		d_off += len;
+		if (s_off == PAGE_SIZE) {
+			s_page = get_next_page(s_page);
+			s_off = 0;
+		}
+		if (d_off == PAGE_SIZE) {
+			d_page = get_next_page(d_page);
+			d_off = 0;
+		}
+	}
+}
+
+/*
+ * Move the allocated objects of zspage @src, from object number *@nr on,
+ * into zspage @dst. Returns 0 once @src is empty, -ENOSPC if @dst filled
+ * up first and -EBUSY if an object of @src is mapped (or being freed) and
+ * so cannot be moved. Called with class->lock held.
+ */
+static int migrate_zspage(struct size_class *class, struct page *src,
+				struct page *dst, unsigned long *nr)
+{
+	unsigned long handle, old_obj, new_obj;
+
+	while (src->inuse) {
+		if (dst->inuse == dst->objects)
+			return -ENOSPC;
+
+		handle = find_alloced_obj(class, src, nr, &old_obj);
+		BUG_ON(!handle);
+		if (!trypin_tag(handle))
+			return -EBUSY;
+
+		new_obj = obj_malloc(class, dst, handle);
+		zs_object_copy(class, new_obj, old_obj);
+		record_obj(handle, new_obj, 1);
+		unpin_tag(handle);
+		obj_free(class, old_obj);
+	}
+
+	return 0;
+}
+
+/*
+ * Number of zspages of this class that would be left unused if its
+ * objects were packed tightly. Called with class->lock held.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_allocated;
+
+	obj_allocated = (unsigned long)class->pages_allocated /
+			class->zspage_order * class->objs_per_zspage;
+	if (obj_allocated <= class->objs_inuse)
+		return 0;
+
+	return (obj_allocated - class->objs_inuse) / class->objs_per_zspage;
+}
+
+/*
+ * Empty the sparsest zspages of @class into the fullest ones and free
+ * them. A zspage with a mapped object is moved to the tail of its list
+ * and the next one is tried. Returns the number of pages freed.
+ */
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct page *src, *dst;
+	enum fullness_group fg;
+	unsigned long nr, busy = 0, freed = 0;
+	int ret;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		fg = ZS_ALMOST_EMPTY;
+		src = class->fullness_list[fg];
+		if (!src) {
+			fg = ZS_ALMOST_FULL;
+			src = class->fullness_list[fg];
+		}
+		if (!src)
+			break;
+
+		/* keep src off the lists so it is never picked as target */
+		remove_zspage(src, class, fg);
+
+		nr = 0;
+		ret = -ENOSPC;
+		while ((dst = find_get_zspage(class))) {
+			ret = migrate_zspage(class, src, dst, &nr);
+			fix_fullness_group(pool, dst);
+			if (ret != -ENOSPC)
+				break;
+		}
+
+		fg = get_fullness_group(src);
+		set_zspage_mapping(src, class->index, fg);
+		if (fg == ZS_EMPTY) {
+			class->pages_allocated -= class->zspage_order;
+			class->pages_compacted += class->zspage_order;
+			freed += class->zspage_order;
+			spin_unlock(&class->lock);
+			free_zspage(src);
+			spin_lock(&class->lock);
+		} else {
+			insert_zspage(src, class, fg);
+		}
+
+		if (ret == -EBUSY) {
+			/* give up once every zspage has been found busy */
+			if (++busy > class->fullness_count[ZS_ALMOST_EMPTY] +
+				     class->fullness_count[ZS_ALMOST_FULL])
+				break;
+			/* insert_zspage() made src the head, make it the tail */
+			if (fg < _ZS_NR_FULLNESS_GROUPS)
+				class->fullness_list[fg] = list_entry(
+					src->lru.next, struct page, lru);
+		} else if (ret)
+			break;
+		cond_resched_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+static unsigned long zs_pages_compactable(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class) * class->zspage_order;
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+static int zs_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	/* compaction does no allocation or I/O, so any reclaim context will do */
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	return min_t(unsigned long, zs_pages_compactable(pool), INT_MAX);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int zs_stats_classes_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+	unsigned long almost_full, almost_empty, obj_used, pages_used;
+	unsigned long obj_allocated, pages_compacted;
+	unsigned long total_objs = 0, total_used_objs = 0;
+	unsigned long total_pages = 0, total_compacted = 0;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s %15s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage", "pages_compacted");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		almost_full = class->fullness_count[ZS_ALMOST_FULL];
+		almost_empty = class->fullness_count[ZS_ALMOST_EMPTY];
+		obj_used = class->objs_inuse;
+		pages_used = class->pages_allocated;
+		pages_compacted = class->pages_compacted;
+		spin_unlock(&class->lock);
+
+		if (!pages_used && !pages_compacted)
+			continue;
+
+		obj_allocated = pages_used / class->zspage_order *
+				class->objs_per_zspage;
+
+		seq_printf(s, " %5d %5d %11lu %12lu %13lu %10lu %10lu %16d %15lu\n",
+			i, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used,
+			class->zspage_order, pages_compacted);
+
+		total_objs += obj_allocated;
+		total_used_objs += obj_used;
+		total_pages += pages_used;
+		total_compacted += pages_compacted;
+	}
+
+	seq_puts(s, "\n");
+	seq_printf(s, " %5s %5s %11s %12s %13lu %10lu %10lu %16s %15lu\n",
+			"Total", "", "", "", total_objs, total_used_objs,
+			total_pages, "", total_compacted);
+
+	return 0;
+}
+
+static int zs_stats_classes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_classes_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_classes_fops = {
+	.open		= zs_stats_classes_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_stat_root)
+		return;
+
+	pool->stat_dentry = debugfs_create_dir(pool->name, zs_stat_root);
+	if (!pool->stat_dentry) {
+		pr_warn("%s: debugfs dir <%s> creation failed\n",
+			__func__, pool->name);
+		return;
+	}
+
+	debugfs_create_file("classes", S_IRUGO, pool->stat_dentry, pool,
+				&zs_stats_classes_fops);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->stat_dentry);
+}
+
+static void zs_stat_init(void)
+{
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+	zs_stat_root = NULL;
+}
+#else
+static void zs_pool_stat_create(struct zs_pool *pool) { }
+static void zs_pool_stat_destroy(struct zs_pool *pool) { }
+static void zs_stat_init(void) { }
+static void zs_stat_exit(void) { }
+#endif
 
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
@@ -435,18 +856,17 @@ static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 	switch (action) {
 	case CPU_UP_PREPARE:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
+		if (area->vm_buf)
 			break;
-		area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
-		if (!area->vm)
+		area->vm_buf = (char *)__get_free_page(GFP_KERNEL);
+		if (!area->vm_buf)
 			return notifier_from_errno(-ENOMEM);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			free_vm_area(area->vm);
-		area->vm = NULL;
+		free_page((unsigned long)area->vm_buf);
+		area->vm_buf = NULL;
 		break;
 	}
 
@@ -464,12 +884,24 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	zs_stat_exit();
+	if (zs_handle_cachep)
+		kmem_cache_destroy(zs_handle_cachep);
+	zs_handle_cachep = NULL;
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cachep = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+						0, 0, NULL);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	zs_stat_init();
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -508,12 +940,20 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->zspage_order = get_zspage_order(size);
+		class->objs_per_zspage = class->zspage_order * PAGE_SIZE /
+						size;
 
 	}
 
 	pool->flags = flags;
 	pool->name = name;
 
+	zs_pool_stat_create(pool);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -522,6 +962,9 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+	zs_pool_stat_destroy(pool);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -542,28 +985,31 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, a handle to the allocated object is returned,
+ * otherwise NULL. The handle stays valid even if compaction
+ * moves the object; use zs_map_object() to access it.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cachep,
+				pool->flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+	if (unlikely(!handle))
 		return NULL;
 
+	/* the object is prefixed with its handle (see OBJ_ALLOCATED_TAG) */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
@@ -574,77 +1020,106 @@ void *zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			kmem_cache_free(zs_handle_cachep, (void *)handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->zspage_order;
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(class, first_page, handle);
+	record_obj(handle, obj, 0);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return (void *)handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *ptr)
 {
-	struct link_free *link;
+	unsigned long handle = (unsigned long)ptr;
+	unsigned long obj, f_objidx;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* keep compaction from moving the object under us */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->zspage_order;
 
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
-void *zs_map_object(struct zs_pool *pool, void *handle)
+/*
+ * An object that spans two pages is copied into this CPU's buffer, and
+ * copied back when it is unmapped.  That needs nothing but kmap_atomic(),
+ * unlike mapping both pages at consecutive kernel addresses, which needs
+ * page table and TLB manipulation that is not portable.
+ */
+static void zs_copy_from_pages(char *buf, struct page *page, int off,
+				int size)
+{
+	int first = PAGE_SIZE - off;
+	void *addr;
+
+	addr = kmap_atomic(page);
+	memcpy(buf, addr + off, first);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(get_next_page(page));
+	memcpy(buf + first, addr, size - first);
+	kunmap_atomic(addr);
+}
+
+static void zs_copy_to_pages(const char *buf, struct page *page, int off,
+				int size)
 {
+	int first = PAGE_SIZE - off;
+	void *addr;
+
+	addr = kmap_atomic(page);
+	memcpy(addr + off, buf, first);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(get_next_page(page));
+	memcpy(addr, buf + first, size - first);
+	kunmap_atomic(addr);
+}
+
+/*
+ * The object stays pinned, and so is not moved by compaction, until it is
+ * unmapped. Only one object may be mapped at a time on each CPU, and the
+ * caller must not sleep until it is unmapped.
+ */
+void *zs_map_object(struct zs_pool *pool, void *ptr)
+{
+	unsigned long handle = (unsigned long)ptr;
 	struct page *page;
 	unsigned long obj_idx, off;
 
@@ -655,7 +1130,8 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	pin_tag(handle);
+	obj_to_location(handle_to_obj(handle), &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -664,27 +1140,21 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-	} else {
-		/* this object spans two pages */
-		struct page *nextp;
-
-		nextp = get_next_page(page);
-		BUG_ON(!nextp);
-
-
-		set_pte(area->vm_ptes[0], mk_pte(page, PAGE_KERNEL));
-		set_pte(area->vm_ptes[1], mk_pte(nextp, PAGE_KERNEL));
-
-		/* We pre-allocated VM area so mapping can never fail */
-		area->vm_addr = area->vm->addr;
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
-	return area->vm_addr + off;
+	/* this object spans two pages; as kmap_atomic(), no page faults */
+	pagefault_disable();
+	zs_copy_from_pages(area->vm_buf, page, off, class->size);
+	area->vm_addr = area->vm_buf;
+
+	return area->vm_addr + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
-void zs_unmap_object(struct zs_pool *pool, void *handle)
+void zs_unmap_object(struct zs_pool *pool, void *ptr)
 {
+	unsigned long handle = (unsigned long)ptr;
 	struct page *page;
 	unsigned long obj_idx, off;
 
@@ -695,7 +1165,7 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj_to_location(handle_to_obj(handle), &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -704,12 +1174,11 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 	if (off + class->size <= PAGE_SIZE) {
 		kunmap_atomic(area->vm_addr);
 	} else {
-		set_pte(area->vm_ptes[0], __pte(0));
-		set_pte(area->vm_ptes[1], __pte(0));
-		__flush_tlb_one((unsigned long)area->vm_addr);
-		__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+		zs_copy_to_pages(area->vm_buf, page, off, class->size);
+		pagefault_enable();
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
@@ -725,6 +1194,28 @@ u64 zs_get_total_size_bytes(struct zs_pool *pool)
 }
 EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
 
+/**
+ * zs_compact - Move objects out of sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Objects are moved between zspages of the same size class so that the
+ * zspages they leave behind can be freed. Mapped objects are not moved.
+ * This is also done by the pool's shrinker under memory pressure.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += __zs_compact(pool, &pool->size_class[i]);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
 module_init(zs_init);
 module_exit(zs_exit);
 
@@ -15,6 +15,7 @@
 
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
+#include <linux/shrinker.h>
 #include <linux/types.h>
 
 /*
@@ -34,12 +35,18 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single unsigned long value.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
+ * The handle given out to users is not the location itself but a
+ * pointer to a separately allocated word holding it, so that compaction
+ * can move objects around by rewriting that word. The location is
+ * stored shifted left by OBJ_TAG_BITS, leaving the low bit free for
+ * use as a tag (see HANDLE_PIN_BIT and OBJ_ALLOCATED_TAG).
+ *
  * This is made more complicated by various memory models and PAE.
  */
 
@@ -49,15 +56,30 @@
 #else /* !CONFIG_HIGHMEM64G */
 /*
  * If this definition of MAX_PHYSMEM_BITS is used, OBJ_INDEX_BITS will just
- * be PAGE_SHIFT
+ * be PAGE_SHIFT - OBJ_TAG_BITS
  */
 #define MAX_PHYSMEM_BITS BITS_PER_LONG
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/*
+ * Held in the word a handle points to while the object is mapped or
+ * being freed, and by compaction while it moves the object.
+ */
+#define HANDLE_PIN_BIT		0
+
+/*
+ * Every allocated object starts with its handle, tagged with this bit,
+ * so compaction can tell allocated objects from free ones (whose first
+ * word is a shifted, and so untagged, freelist link).
+ */
+#define OBJ_ALLOCATED_TAG	1
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -110,9 +132,8 @@ enum fullness_group {
 static const int fullness_threshold_frac = 4;
 
 struct mapping_area {
-	struct vm_struct *vm;
-	pte_t *vm_ptes[2];
-	char *vm_addr;
+	char *vm_buf;	/* copy of an object that spans two pages */
+	char *vm_addr;	/* address of the object's kmap'ed page or vm_buf */
 };
 
 struct size_class {
@@ -125,11 +146,16 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int zspage_order;
+	/* Number of objects a zspage of this class can store */
+	int objs_per_zspage;
 
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	u64 pages_compacted;
+	unsigned long objs_inuse;
+	unsigned long fullness_count[_ZS_NR_FULLNESS_GROUPS];
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -137,12 +163,17 @@ struct size_class {
 /*
  * Placed within free objects to form a singly linked list.
  * For every zspage, first_page->freelist gives head of this list.
+ * Allocated objects keep their handle in the same place instead.
  *
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* Location of next free chunk, shifted by OBJ_TAG_BITS */
+		unsigned long next;
+		/* Handle of this chunk, tagged with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -150,6 +181,10 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	struct dentry *stat_dentry;
 };
 
 #endif
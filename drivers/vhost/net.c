@@ -18,6 +18,7 @@
 #include <linux/rcupdate.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include <linux/net.h>
 #include <linux/if_packet.h>
@@ -34,6 +35,11 @@ static int experimental_zcopytx;
 module_param(experimental_zcopytx, int, 0444);
 MODULE_PARM_DESC(experimental_zcopytx, "Enable Experimental Zero Copy TX");
 
+static int max_queue_pairs = 1;
+module_param(max_queue_pairs, int, 0444);
+MODULE_PARM_DESC(max_queue_pairs,
+		 "Number of RX/TX virtqueue pairs per device, each with its own worker");
+
 /* Max number of bytes transferred before requeueing the job.
  * Using this limit prevents one virtqueue from starving others. */
 #define VHOST_NET_WEIGHT 0x80000
@@ -42,6 +48,11 @@ MODULE_PARM_DESC(experimental_zcopytx, "Enable Experimental Zero Copy TX");
 #define VHOST_MAX_PEND 128
 #define VHOST_GOODCOPY_LEN 256
 
+#define VHOST_NET_MAX_QUEUE_PAIRS VHOST_MAX_WORKERS
+
+/* Virtqueues within a queue pair: pair p uses vqs p * VHOST_NET_VQ_MAX
+ * + VHOST_NET_VQ_RX and p * VHOST_NET_VQ_MAX + VHOST_NET_VQ_TX, the same
+ * layout as a multiqueue virtio-net guest. */
 enum {
 	VHOST_NET_VQ_RX = 0,
 	VHOST_NET_VQ_TX = 1,
@@ -56,14 +67,28 @@ enum vhost_net_poll_state {
 
 struct vhost_net {
 	struct vhost_dev dev;
-	struct vhost_virtqueue vqs[VHOST_NET_VQ_MAX];
-	struct vhost_poll poll[VHOST_NET_VQ_MAX];
-	/* Tells us whether we are polling a socket for TX.
+	int npairs;
+	struct vhost_virtqueue *vqs;
+	/* Socket polls, indexed like vqs. */
+	struct vhost_poll *poll;
+	/* Tells us whether we are polling a socket for TX, per queue pair.
 	 * We only do this when socket buffer fills up.
 	 * Protected by tx vq lock. */
-	enum vhost_net_poll_state tx_poll_state;
+	enum vhost_net_poll_state *tx_poll_state;
 };
 
+static inline bool vhost_net_vq_is_tx(struct vhost_net *net,
+				      struct vhost_virtqueue *vq)
+{
+	return (vq - net->vqs) % VHOST_NET_VQ_MAX == VHOST_NET_VQ_TX;
+}
+
+static inline enum vhost_net_poll_state *
+vhost_net_tx_poll_state(struct vhost_net *net, struct vhost_virtqueue *vq)
+{
+	return &net->tx_poll_state[(vq - net->vqs) / VHOST_NET_VQ_MAX];
+}
+
 static bool vhost_sock_zcopy(struct socket *sock)
 {
 	return unlikely(experimental_zcopytx) &&
@@ -109,28 +134,32 @@ static void copy_iovec_hdr(const struct iovec *from, struct iovec *to,
 }
 
 /* Caller must have TX VQ lock */
-static void tx_poll_stop(struct vhost_net *net)
+static void tx_poll_stop(struct vhost_net *net, struct vhost_virtqueue *vq)
 {
-	if (likely(net->tx_poll_state != VHOST_NET_POLL_STARTED))
+	enum vhost_net_poll_state *state = vhost_net_tx_poll_state(net, vq);
+
+	if (likely(*state != VHOST_NET_POLL_STARTED))
 		return;
-	vhost_poll_stop(net->poll + VHOST_NET_VQ_TX);
-	net->tx_poll_state = VHOST_NET_POLL_STOPPED;
+	vhost_poll_stop(net->poll + (vq - net->vqs));
+	*state = VHOST_NET_POLL_STOPPED;
 }
 
 /* Caller must have TX VQ lock */
-static void tx_poll_start(struct vhost_net *net, struct socket *sock)
+static void tx_poll_start(struct vhost_net *net, struct vhost_virtqueue *vq,
+			  struct socket *sock)
 {
-	if (unlikely(net->tx_poll_state != VHOST_NET_POLL_STOPPED))
+	enum vhost_net_poll_state *state = vhost_net_tx_poll_state(net, vq);
+
+	if (unlikely(*state != VHOST_NET_POLL_STOPPED))
 		return;
-	vhost_poll_start(net->poll + VHOST_NET_VQ_TX, sock->file);
-	net->tx_poll_state = VHOST_NET_POLL_STARTED;
+	vhost_poll_start(net->poll + (vq - net->vqs), sock->file);
+	*state = VHOST_NET_POLL_STARTED;
 }
 
 /* Expects to be always run from workqueue - which acts as
  * read-size critical section for our kind of RCU. */
-static void handle_tx(struct vhost_net *net)
+static void handle_tx(struct vhost_net *net, struct vhost_virtqueue *vq)
 {
-	struct vhost_virtqueue *vq = &net->dev.vqs[VHOST_NET_VQ_TX];
 	unsigned out, in, s;
 	int head;
 	struct msghdr msg = {
@@ -156,7 +185,7 @@ static void handle_tx(struct vhost_net *net)
 	wmem = atomic_read(&sock->sk->sk_wmem_alloc);
 	if (wmem >= sock->sk->sk_sndbuf) {
 		mutex_lock(&vq->mutex);
-		tx_poll_start(net, sock);
+		tx_poll_start(net, vq, sock);
 		mutex_unlock(&vq->mutex);
 		return;
 	}
@@ -165,7 +194,7 @@ static void handle_tx(struct vhost_net *net)
 	vhost_disable_notify(&net->dev, vq);
 
 	if (wmem < sock->sk->sk_sndbuf / 2)
-		tx_poll_stop(net);
+		tx_poll_stop(net, vq);
 	hdr_size = vq->vhost_hlen;
 	zcopy = vhost_sock_zcopy(sock);
 
@@ -187,7 +216,7 @@ static void handle_tx(struct vhost_net *net)
 
 			wmem = atomic_read(&sock->sk->sk_wmem_alloc);
 			if (wmem >= sock->sk->sk_sndbuf * 3 / 4) {
-				tx_poll_start(net, sock);
+				tx_poll_start(net, vq, sock);
 				set_bit(SOCK_ASYNC_NOSPACE, &sock->flags);
 				break;
 			}
@@ -198,7 +227,7 @@ static void handle_tx(struct vhost_net *net)
 				    (vq->upend_idx - vq->done_idx) :
 				    (vq->upend_idx + UIO_MAXIOV - vq->done_idx);
 			if (unlikely(num_pends > VHOST_MAX_PEND)) {
-				tx_poll_start(net, sock);
+				tx_poll_start(net, vq, sock);
 				set_bit(SOCK_ASYNC_NOSPACE, &sock->flags);
 				break;
 			}
@@ -258,7 +287,7 @@ static void handle_tx(struct vhost_net *net)
 					UIO_MAXIOV;
 			}
 			vhost_discard_vq_desc(vq, 1);
-			tx_poll_start(net, sock);
+			tx_poll_start(net, vq, sock);
 			break;
 		}
 		if (err != len)
@@ -358,9 +387,8 @@ err:
 
 /* Expects to be always run from workqueue - which acts as
  * read-size critical section for our kind of RCU. */
-static void handle_rx(struct vhost_net *net)
+static void handle_rx(struct vhost_net *net, struct vhost_virtqueue *vq)
 {
-	struct vhost_virtqueue *vq = &net->dev.vqs[VHOST_NET_VQ_RX];
 	unsigned uninitialized_var(in), log;
 	struct vhost_log *vq_log;
 	struct msghdr msg = {
@@ -471,7 +499,7 @@ static void handle_tx_kick(struct vhost_work *work)
 						  poll.work);
 	struct vhost_net *net = container_of(vq->dev, struct vhost_net, dev);
 
-	handle_tx(net);
+	handle_tx(net, vq);
 }
 
 static void handle_rx_kick(struct vhost_work *work)
@@ -480,44 +508,81 @@ static void handle_rx_kick(struct vhost_work *work)
 						  poll.work);
 	struct vhost_net *net = container_of(vq->dev, struct vhost_net, dev);
 
-	handle_rx(net);
+	handle_rx(net, vq);
 }
 
 static void handle_tx_net(struct vhost_work *work)
 {
-	struct vhost_net *net = container_of(work, struct vhost_net,
-					     poll[VHOST_NET_VQ_TX].work);
-	handle_tx(net);
+	struct vhost_poll *poll = container_of(work, struct vhost_poll, work);
+	struct vhost_net *net = container_of(poll->dev, struct vhost_net, dev);
+
+	handle_tx(net, net->vqs + (poll - net->poll));
 }
 
 static void handle_rx_net(struct vhost_work *work)
 {
-	struct vhost_net *net = container_of(work, struct vhost_net,
-					     poll[VHOST_NET_VQ_RX].work);
-	handle_rx(net);
+	struct vhost_poll *poll = container_of(work, struct vhost_poll, work);
+	struct vhost_net *net = container_of(poll->dev, struct vhost_net, dev);
+
+	handle_rx(net, net->vqs + (poll - net->poll));
+}
+
+/* With several queue pairs the virtqueues no longer fit in a kmalloc. */
+static void vhost_net_free(struct vhost_net *n)
+{
+	if (is_vmalloc_addr(n))
+		vfree(n);
+	else
+		kfree(n);
 }
 
 static int vhost_net_open(struct inode *inode, struct file *f)
 {
-	struct vhost_net *n = kmalloc(sizeof *n, GFP_KERNEL);
+	int npairs = max_queue_pairs;
+	int nvqs = npairs * VHOST_NET_VQ_MAX;
+	size_t size = sizeof(struct vhost_net) +
+		      nvqs * (sizeof(struct vhost_virtqueue) +
+			      sizeof(struct vhost_poll)) +
+		      npairs * sizeof(enum vhost_net_poll_state);
+	struct vhost_net *n;
 	struct vhost_dev *dev;
-	int r;
+	int i, r;
 
+	n = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (!n)
+		n = vmalloc(size);
 	if (!n)
 		return -ENOMEM;
 
+	n->npairs = npairs;
+	n->vqs = (struct vhost_virtqueue *)(n + 1);
+	n->poll = (struct vhost_poll *)(n->vqs + nvqs);
+	n->tx_poll_state = (enum vhost_net_poll_state *)(n->poll + nvqs);
+
 	dev = &n->dev;
-	n->vqs[VHOST_NET_VQ_TX].handle_kick = handle_tx_kick;
-	n->vqs[VHOST_NET_VQ_RX].handle_kick = handle_rx_kick;
-	r = vhost_dev_init(dev, n->vqs, VHOST_NET_VQ_MAX);
+	for (i = 0; i < nvqs; i += VHOST_NET_VQ_MAX) {
+		n->vqs[i + VHOST_NET_VQ_TX].handle_kick = handle_tx_kick;
+		n->vqs[i + VHOST_NET_VQ_RX].handle_kick = handle_rx_kick;
+	}
+	r = vhost_dev_init(dev, n->vqs, nvqs, npairs);
 	if (r < 0) {
-		kfree(n);
+		vhost_net_free(n);
 		return r;
 	}
 
-	vhost_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, POLLOUT, dev);
-	vhost_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, POLLIN, dev);
-	n->tx_poll_state = VHOST_NET_POLL_DISABLED;
+	for (i = 0; i < nvqs; i += VHOST_NET_VQ_MAX) {
+		vhost_poll_init(n->poll + i + VHOST_NET_VQ_TX, handle_tx_net,
+				POLLOUT, dev);
+		vhost_poll_init(n->poll + i + VHOST_NET_VQ_RX, handle_rx_net,
+				POLLIN, dev);
+		/* Socket wakeups run on the worker serving the queue pair */
+		n->poll[i + VHOST_NET_VQ_TX].worker =
+			vhost_vq_worker(n->vqs + i + VHOST_NET_VQ_TX);
+		n->poll[i + VHOST_NET_VQ_RX].worker =
+			vhost_vq_worker(n->vqs + i + VHOST_NET_VQ_RX);
+		n->tx_poll_state[i / VHOST_NET_VQ_MAX] =
+			VHOST_NET_POLL_DISABLED;
+	}
 
 	f->private_data = n;
 
@@ -529,11 +594,11 @@ static void vhost_net_disable_vq(struct vhost_net *n,
 {
 	if (!vq->private_data)
 		return;
-	if (vq == n->vqs + VHOST_NET_VQ_TX) {
-		tx_poll_stop(n);
-		n->tx_poll_state = VHOST_NET_POLL_DISABLED;
+	if (vhost_net_vq_is_tx(n, vq)) {
+		tx_poll_stop(n, vq);
+		*vhost_net_tx_poll_state(n, vq) = VHOST_NET_POLL_DISABLED;
 	} else
-		vhost_poll_stop(n->poll + VHOST_NET_VQ_RX);
+		vhost_poll_stop(n->poll + (vq - n->vqs));
 }
 
 static void vhost_net_enable_vq(struct vhost_net *n,
@@ -545,11 +610,11 @@ static void vhost_net_enable_vq(struct vhost_net *n,
 					 lockdep_is_held(&vq->mutex));
 	if (!sock)
 		return;
-	if (vq == n->vqs + VHOST_NET_VQ_TX) {
-		n->tx_poll_state = VHOST_NET_POLL_STOPPED;
-		tx_poll_start(n, sock);
+	if (vhost_net_vq_is_tx(n, vq)) {
+		*vhost_net_tx_poll_state(n, vq) = VHOST_NET_POLL_STOPPED;
+		tx_poll_start(n, vq, sock);
 	} else
-		vhost_poll_start(n->poll + VHOST_NET_VQ_RX, sock->file);
+		vhost_poll_start(n->poll + (vq - n->vqs), sock->file);
 }
 
 static struct socket *vhost_net_stop_vq(struct vhost_net *n,
@@ -566,11 +631,21 @@ static struct socket *vhost_net_stop_vq(struct vhost_net *n,
 	return sock;
 }
 
-static void vhost_net_stop(struct vhost_net *n, struct socket **tx_sock,
-			   struct socket **rx_sock)
+static void vhost_net_stop(struct vhost_net *n, struct socket **socks)
+{
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; ++i)
+		socks[i] = vhost_net_stop_vq(n, n->vqs + i);
+}
+
+static void vhost_net_put_socks(struct vhost_net *n, struct socket **socks)
 {
-	*tx_sock = vhost_net_stop_vq(n, n->vqs + VHOST_NET_VQ_TX);
-	*rx_sock = vhost_net_stop_vq(n, n->vqs + VHOST_NET_VQ_RX);
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; ++i)
+		if (socks[i])
+			fput(socks[i]->file);
 }
 
 static void vhost_net_flush_vq(struct vhost_net *n, int index)
@@ -581,27 +656,25 @@ static void vhost_net_flush_vq(struct vhost_net *n, int index)
 
 static void vhost_net_flush(struct vhost_net *n)
 {
-	vhost_net_flush_vq(n, VHOST_NET_VQ_TX);
-	vhost_net_flush_vq(n, VHOST_NET_VQ_RX);
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; ++i)
+		vhost_net_flush_vq(n, i);
 }
 
 static int vhost_net_release(struct inode *inode, struct file *f)
 {
 	struct vhost_net *n = f->private_data;
-	struct socket *tx_sock;
-	struct socket *rx_sock;
+	struct socket *socks[VHOST_NET_MAX_QUEUE_PAIRS * VHOST_NET_VQ_MAX];
 
-	vhost_net_stop(n, &tx_sock, &rx_sock);
+	vhost_net_stop(n, socks);
 	vhost_net_flush(n);
 	vhost_dev_cleanup(&n->dev, false);
-	if (tx_sock)
-		fput(tx_sock->file);
-	if (rx_sock)
-		fput(rx_sock->file);
+	vhost_net_put_socks(n, socks);
 	/* We do an extra flush before freeing memory,
 	 * since jobs can re-queue themselves. */
 	vhost_net_flush(n);
-	kfree(n);
+	vhost_net_free(n);
 	return 0;
 }
 
@@ -682,7 +755,7 @@ static long vhost_net_set_backend(struct vhost_net *n, unsigned index, int fd)
 	if (r)
 		goto err;
 
-	if (index >= VHOST_NET_VQ_MAX) {
+	if (index >= n->dev.nvqs) {
 		r = -ENOBUFS;
 		goto err;
 	}
@@ -748,23 +821,19 @@ err:
 
 static long vhost_net_reset_owner(struct vhost_net *n)
 {
-	struct socket *tx_sock = NULL;
-	struct socket *rx_sock = NULL;
+	struct socket *socks[VHOST_NET_MAX_QUEUE_PAIRS * VHOST_NET_VQ_MAX] = {};
 	long err;
 
 	mutex_lock(&n->dev.mutex);
 	err = vhost_dev_check_owner(&n->dev);
 	if (err)
 		goto done;
-	vhost_net_stop(n, &tx_sock, &rx_sock);
+	vhost_net_stop(n, socks);
 	vhost_net_flush(n);
 	err = vhost_dev_reset_owner(&n->dev);
 done:
 	mutex_unlock(&n->dev.mutex);
-	if (tx_sock)
-		fput(tx_sock->file);
-	if (rx_sock)
-		fput(rx_sock->file);
+	vhost_net_put_socks(n, socks);
 	return err;
 }
 
@@ -793,7 +862,7 @@ static int vhost_net_set_features(struct vhost_net *n, u64 features)
 	}
 	n->dev.acked_features = features;
 	smp_wmb();
-	for (i = 0; i < VHOST_NET_VQ_MAX; ++i) {
+	for (i = 0; i < n->dev.nvqs; ++i) {
 		mutex_lock(&n->vqs[i].mutex);
 		n->vqs[i].vhost_hlen = vhost_hlen;
 		n->vqs[i].sock_hlen = sock_hlen;
@@ -868,8 +937,15 @@ static struct miscdevice vhost_net_misc = {
 
 static int vhost_net_init(void)
 {
+	int i;
+
+	if (max_queue_pairs < 1 ||
+	    max_queue_pairs > VHOST_NET_MAX_QUEUE_PAIRS)
+		return -EINVAL;
 	if (experimental_zcopytx)
-		vhost_enable_zcopy(VHOST_NET_VQ_TX);
+		for (i = 0; i < max_queue_pairs; ++i)
+			vhost_enable_zcopy(i * VHOST_NET_VQ_MAX +
+					   VHOST_NET_VQ_TX);
 	return misc_register(&vhost_net_misc);
 }
 module_init(vhost_net_init);
@@ -19,6 +19,7 @@
 #define VHOST_DMA_CLEAR_LEN	0
 
 struct vhost_device;
+struct vhost_worker;
 
 struct vhost_work;
 typedef void (*vhost_work_fn_t)(struct vhost_work *work);
@@ -41,6 +42,7 @@ struct vhost_poll {
 	struct vhost_work	  work;
 	unsigned long		  mask;
 	struct vhost_dev	 *dev;
+	struct vhost_worker	 *worker;
 };
 
 void vhost_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
@@ -143,6 +145,17 @@ struct vhost_virtqueue {
 	struct vhost_ubuf_ref *ubufs;
 };
 
+/* Upper bound on the worker threads serving one device. */
+#define VHOST_MAX_WORKERS 16
+
+/* A kernel thread running the works queued by the virtqueues bound to it. */
+struct vhost_worker {
+	spinlock_t work_lock;
+	struct list_head work_list;
+	struct task_struct *task;
+	struct vhost_dev *dev;
+};
+
 struct vhost_dev {
 	/* Readers use RCU to access memory table pointer
 	 * log base pointer and features.
@@ -155,12 +168,21 @@ struct vhost_dev {
 	int nvqs;
 	struct file *log_file;
 	struct eventfd_ctx *log_ctx;
-	spinlock_t work_lock;
-	struct list_head work_list;
-	struct task_struct *worker;
+	/* Virtqueues are spread evenly over the workers, in order:
+	 * vq i is served by worker i * nworkers / nvqs. */
+	struct vhost_worker workers[VHOST_MAX_WORKERS];
+	int nworkers;
 };
 
-long vhost_dev_init(struct vhost_dev *, struct vhost_virtqueue *vqs, int nvqs);
+static inline struct vhost_worker *vhost_vq_worker(struct vhost_virtqueue *vq)
+{
+	struct vhost_dev *dev = vq->dev;
+
+	return &dev->workers[(vq - dev->vqs) * dev->nworkers / dev->nvqs];
+}
+
+long vhost_dev_init(struct vhost_dev *, struct vhost_virtqueue *vqs, int nvqs,
+		    int nworkers);
 long vhost_dev_check_owner(struct vhost_dev *);
 long vhost_dev_reset_owner(struct vhost_dev *);
 void vhost_dev_cleanup(struct vhost_dev *, bool locked);
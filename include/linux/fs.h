@@ -947,6 +947,18 @@ struct fown_struct {
 	int signum;		/* posix.1b rt signal to be delivered on IO */
 };
 
+/*
+ * Number of sequential streams, besides the current one, whose readahead
+ * windows are remembered for interleaved reads of the same file.
+ */
+#define RA_NR_STREAMS	3
+
+struct file_ra_window {
+	pgoff_t start;
+	unsigned int size;
+	unsigned int async_size;
+};
+
 /*
  * Track a single file's readahead state
  */
@@ -959,6 +971,13 @@ struct file_ra_state {
 	unsigned int ra_pages;		/* Maximum readahead window */
 	unsigned int mmap_miss;		/* Cache miss stat for mmap accesses */
 	loff_t prev_pos;		/* Cache last read() position */
+
+	/* windows of other streams, most recently used first */
+	struct file_ra_window streams[RA_NR_STREAMS];
+
+	pgoff_t stride_prev;		/* last page of strided reads issued */
+	long stride;			/* distance between strided reads */
+	unsigned int stride_count;	/* # of times the stride repeated */
 };
 
 /*
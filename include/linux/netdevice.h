@@ -323,6 +323,14 @@ struct netdev_boot_setup {
 
 extern int __init netdev_boot_setup(char *str);
 
+/* GRO holds skbs in buckets selected by skb->rxhash */
+#define GRO_HASH_BUCKETS	8
+
+struct gro_list {
+	struct sk_buff		*list;
+	unsigned int		count;
+};
+
 /*
  * Structure for NAPI scheduling similar to tasklet but with weighting
  */
@@ -343,18 +351,29 @@ struct napi_struct {
 	int			poll_owner;
 #endif
 
-	unsigned int		gro_count;
+	/* Buckets of gro_hash[] holding skbs */
+	unsigned long		gro_bitmask;
 
 	struct net_device	*dev;
 	struct list_head	dev_list;
-	struct sk_buff		*gro_list;
+	struct gro_list		gro_hash[GRO_HASH_BUCKETS];
 	struct sk_buff		*skb;
+	/* Flushes held skbs after dev->gro_flush_timeout */
+	struct hrtimer		timer;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* Lets sockets find their way back to the NAPI context that
+	 * delivered their last packet, see sk_busy_loop().
+	 */
+	unsigned int		napi_id;
+	struct hlist_node	napi_hash_node;
+#endif
 };
 
 enum {
 	NAPI_STATE_SCHED,	/* Poll is scheduled */
 	NAPI_STATE_DISABLE,	/* Disable pending */
 	NAPI_STATE_NPSVC,	/* Netpoll - don't dequeue from poll_list */
+	NAPI_STATE_HASHED,	/* In NAPI hash (busy polling possible) */
 };
 
 enum gro_result {
@@ -482,6 +501,7 @@ static inline void napi_disable(struct napi_struct *n)
 	set_bit(NAPI_STATE_DISABLE, &n->state);
 	while (test_and_set_bit(NAPI_STATE_SCHED, &n->state))
 		msleep(1);
+	hrtimer_cancel(&n->timer);
 	clear_bit(NAPI_STATE_DISABLE, &n->state);
 }
 
@@ -663,6 +683,8 @@ extern struct rps_sock_flow_table __rcu *rps_sock_flow_table;
 #ifdef CONFIG_RFS_ACCEL
 extern bool rps_may_expire_flow(struct net_device *dev, u16 rxq_index,
 				u32 flow_id, u16 filter_id);
+extern void netif_set_rx_queue_irq(struct net_device *dev, u16 rxq_index,
+				   unsigned int irq);
 #endif
 
 /* This structure contains an instance of an RX queue. */
@@ -671,6 +693,19 @@ struct netdev_rx_queue {
 	struct rps_dev_flow_table __rcu	*rps_flow_table;
 	struct kobject			kobj;
 	struct net_device		*dev;
+#ifdef CONFIG_RFS_ACCEL
+	/* Software RFS acceleration: interrupt of this queue, the CPU
+	 * the flows it receives are voting for, and the work moving the
+	 * interrupt there.  Protected by steer_lock.
+	 */
+	spinlock_t			steer_lock;
+	unsigned int			irq;
+	u16				steer_cpu;
+	u16				steer_votes;
+	u16				steer_target;
+	unsigned long			steer_stamp;
+	struct work_struct		steer_work;
+#endif
 } ____cacheline_aligned_in_smp;
 #endif /* CONFIG_RPS */
 
@@ -1186,6 +1221,9 @@ struct net_device {
 	rx_handler_func_t __rcu	*rx_handler;
 	void __rcu		*rx_handler_data;
 
+	/* Time (ns) GRO may hold packets after a poll, 0 to flush at once */
+	unsigned long		gro_flush_timeout;
+
 	struct netdev_queue __rcu *ingress_queue;
 
 /*
@@ -1477,6 +1515,9 @@ struct napi_gro_cb {
 
 	/* Free the skb? */
 	int free;
+
+	/* local_clock() when the skb started to be held. */
+	u64 age;
 };
 
 #define NAPI_GRO_CB(skb) ((struct napi_gro_cb *)(skb)->cb)
@@ -1720,6 +1761,9 @@ struct softnet_data {
 	unsigned int		time_squeeze;
 	unsigned int		cpu_collision;
 	unsigned int		received_rps;
+	unsigned int		gro_merged;	/* merged into a held skb */
+	unsigned int		gro_flushed;	/* held skbs passed up */
+	unsigned int		gro_evicted;	/* ... to make room in a bucket */
 
 #ifdef CONFIG_RPS
 	struct softnet_data	*rps_ipi_list;
@@ -40,6 +40,12 @@ struct inet_peer {
 	u32			pmtu_orig;
 	u32			pmtu_learned;
 	struct inetpeer_addr_base redirect_learned;
+	/* TCP Fast Open client cache, see tcp_fastopen_cache_get() */
+	u16			tfo_mss;	/* MSS learnt from the last SYN-ACK */
+	s8			tfo_cookie_len;
+	u8			tfo_syn_loss;	/* Recurring Fast Open SYN losses */
+	unsigned long		tfo_last_syn_loss; /* Last Fast Open SYN loss */
+	u8			tfo_cookie[16];	/* TCP_FASTOPEN_COOKIE_MAX */
 	union {
 		struct list_head	gc_list;
 		struct rcu_head     gc_rcu;
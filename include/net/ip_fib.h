@@ -62,6 +62,9 @@ struct fib_nh {
 	__be32			nh_gw;
 	__be32			nh_saddr;
 	int			nh_saddr_genid;
+	bool			nh_exceptions;
+#define FIB_NH_INPUT_CACHE	4
+	struct rtable __rcu	*nh_rth_input[FIB_NH_INPUT_CACHE];
 };
 
 /*
@@ -126,6 +126,8 @@ struct xfrm_state_walk {
 	u32			seq;
 };
 
+struct xfrm_lft_pcpu;
+
 /* Full description of state of transformer. */
 struct xfrm_state {
 #ifdef CONFIG_NET_NS
@@ -213,6 +215,13 @@ struct xfrm_state {
 	struct xfrm_lifetime_cur curlft;
 	struct tasklet_hrtimer	mtimer;
 
+	/* Per-CPU shares of curlft not folded in yet, whether packets
+	 * may be accounted there, and whether they ever were, see
+	 * xfrm_state_lft_add() */
+	struct xfrm_lft_pcpu __percpu *pcpu_lft;
+	bool			lft_nolock;
+	bool			lft_pcpu_used;
+
 	/* Last used time */
 	unsigned long		lastused;
 
@@ -271,6 +280,8 @@ struct xfrm_replay {
 			 __be32 net_seq);
 	void	(*notify)(struct xfrm_state *x, int event);
 	int	(*overflow)(struct xfrm_state *x, struct sk_buff *skb);
+	/* Optional, called without x->lock when replay events are off */
+	int	(*overflow_nolock)(struct xfrm_state *x, struct sk_buff *skb);
 };
 
 struct net_device;
@@ -1392,6 +1403,10 @@ extern struct xfrm_state *xfrm_stateonly_find(struct net *net, u32 mark,
 					       unsigned short family,
 					       u8 mode, u8 proto, u32 reqid);
 extern int xfrm_state_check_expire(struct xfrm_state *x);
+extern bool xfrm_state_lft_add(struct xfrm_state *x, unsigned int len);
+extern void __xfrm_state_lft_add(struct xfrm_state *x, unsigned int len);
+extern void xfrm_state_get_curlft(const struct xfrm_state *x,
+				  struct xfrm_lifetime_cur *curlft);
 extern void xfrm_state_insert(struct xfrm_state *x);
 extern int xfrm_state_add(struct xfrm_state *x);
 extern int xfrm_state_update(struct xfrm_state *x);
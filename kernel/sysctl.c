@@ -253,6 +253,9 @@ static int max_sched_tunable_scaling = SCHED_TUNABLESCALING_END-1;
 #ifdef CONFIG_COMPACTION
 static int min_extfrag_threshold;
 static int max_extfrag_threshold = 1000;
+static int max_compaction_proactive_order = MAX_ORDER - 1;
+static int min_compaction_proactive_interval = 10;		/* 10 msecs */
+static int max_compaction_proactive_interval = 60000;	/* 1 minute */
 #endif
 
 static struct ctl_table kern_table[] = {
@@ -1188,6 +1191,24 @@ static struct ctl_table vm_table[] = {
 		.extra1		= &min_extfrag_threshold,
 		.extra2		= &max_extfrag_threshold,
 	},
+	{
+		.procname	= "compaction_proactive_order",
+		.data		= &sysctl_compaction_proactive_order,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= sysctl_compaction_proactive_handler,
+		.extra1		= &zero,
+		.extra2		= &max_compaction_proactive_order,
+	},
+	{
+		.procname	= "compaction_proactive_interval",
+		.data		= &sysctl_compaction_proactive_interval,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &min_compaction_proactive_interval,
+		.extra2		= &max_compaction_proactive_interval,
+	},
 
 #endif /* CONFIG_COMPACTION */
 	{
@@ -14,6 +14,9 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/cpu.h>
 #include "internal.h"
 
 #define CREATE_TRACE_POINTS
@@ -34,6 +37,7 @@ struct compact_control {
 	unsigned long free_pfn;		/* isolate_freepages search base */
 	unsigned long migrate_pfn;	/* isolate_migratepages search base */
 	bool sync;			/* Synchronous migration */
+	bool proactive;			/* kcompactd defragmenting ahead of demand */
 
 	int order;			/* order a direct compactor needs */
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
@@ -469,6 +473,18 @@ static int compact_finished(struct zone *zone,
 	if (cc->order == -1)
 		return COMPACT_CONTINUE;
 
+	/*
+	 * A proactive run stops once an allocation of the target order
+	 * would succeed above the high watermark, which is the level
+	 * kcompactd_zone_fragmented() judges the zone by.
+	 */
+	if (cc->proactive) {
+		if (zone_watermark_ok(zone, cc->order,
+				      high_wmark_pages(zone), 0, 0))
+			return COMPACT_PARTIAL;
+		return COMPACT_CONTINUE;
+	}
+
 	/* Compaction run is not finished if the watermark is not met */
 	watermark = low_wmark_pages(zone);
 	watermark += (1 << cc->order);
@@ -544,7 +560,9 @@ static int compact_zone(struct zone *zone, struct compact_control *cc)
 {
 	int ret;
 
-	ret = compaction_suitable(zone, cc->order);
+	/* kcompactd has already checked that a proactive run is worthwhile */
+	ret = cc->proactive ? COMPACT_CONTINUE :
+			      compaction_suitable(zone, cc->order);
 	switch (ret) {
 	case COMPACT_PARTIAL:
 	case COMPACT_SKIPPED:
@@ -715,16 +733,6 @@ static int __compact_pgdat(pg_data_t *pgdat, struct compact_control *cc)
 	return 0;
 }
 
-int compact_pgdat(pg_data_t *pgdat, int order)
-{
-	struct compact_control cc = {
-		.order = order,
-		.sync = false,
-	};
-
-	return __compact_pgdat(pgdat, &cc);
-}
-
 static int compact_node(int nid)
 {
 	struct compact_control cc = {
@@ -770,6 +778,244 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * Order that kcompactd keeps available ahead of demand, 0 to disable
+ * proactive compaction, and the interval in milliseconds at which it
+ * checks for fragmentation.
+ */
+int sysctl_compaction_proactive_order = PAGE_ALLOC_COSTLY_ORDER;
+int sysctl_compaction_proactive_interval = 500;
+
+int sysctl_compaction_proactive_handler(struct ctl_table *table, int write,
+			void __user *buffer, size_t *length, loff_t *ppos)
+{
+	int nid;
+	int ret;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (ret || !write)
+		return ret;
+
+	/* Let sleeping kcompactds pick up the new order */
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		wake_up_interruptible(&NODE_DATA(nid)->kcompactd_wait);
+
+	return 0;
+}
+
+/* Do not stretch the proactive interval more than 64 times */
+#define KCOMPACTD_MAX_BACKOFF	COMPACT_MAX_DEFER_SHIFT
+
+/*
+ * Is the zone short of free pages of @order only because free memory is
+ * fragmented?  Like compaction_suitable(), but judged at the high
+ * watermark so that kcompactd acts before kswapd and direct compaction
+ * would have to.
+ */
+static bool kcompactd_zone_fragmented(struct zone *zone, int order)
+{
+	unsigned long watermark;
+	int fragindex;
+
+	watermark = high_wmark_pages(zone);
+	if (zone_watermark_ok(zone, order, watermark, 0, 0))
+		return false;
+
+	/* Enough order-0 pages must be free to hold the migrated copies */
+	if (!zone_watermark_ok(zone, 0, watermark + (2UL << order), 0, 0))
+		return false;
+
+	fragindex = fragmentation_index(zone, order);
+	return fragindex == -1000 || fragindex > sysctl_extfrag_threshold;
+}
+
+/*
+ * Asynchronously compact every fragmented zone in the node.  Returns true
+ * if a zone is still fragmented afterwards, so the caller can back off
+ * instead of rescanning a zone full of unmovable pages.
+ */
+static bool kcompactd_proactive(pg_data_t *pgdat, int order)
+{
+	struct compact_control cc = {
+		.order = order,
+		.sync = false,
+		.proactive = true,
+	};
+	bool fruitless = false;
+	int zoneid;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (!kcompactd_zone_fragmented(zone, order))
+			continue;
+
+		cc.nr_freepages = 0;
+		cc.nr_migratepages = 0;
+		cc.zone = zone;
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		count_vm_event(KCOMPACTD_PROACTIVE);
+		compact_zone(zone, &cc);
+
+		if (!zone_watermark_ok(zone, order, high_wmark_pages(zone), 0, 0))
+			fruitless = true;
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+	}
+
+	return fruitless;
+}
+
+/* Compact on behalf of kswapd, which found the node balanced but fragmented */
+static void kcompactd_do_work(pg_data_t *pgdat)
+{
+	struct compact_control cc = {
+		.order = pgdat->kcompactd_max_order,
+		.sync = true,
+	};
+
+	pgdat->kcompactd_max_order = 0;
+	count_vm_event(KCOMPACTD_WAKE);
+	__compact_pgdat(pgdat, &cc);
+}
+
+/*
+ * The background compaction daemon, one per node.  It is woken by kswapd
+ * once reclaim has balanced the node for order-0 but a high-order request
+ * still cannot be met, and otherwise wakes every
+ * sysctl_compaction_proactive_interval milliseconds to defragment zones
+ * before high-order allocations have to enter the slow path.
+ */
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	struct task_struct *tsk = current;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	unsigned int backoff = 0;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(tsk, cpumask);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		int order = sysctl_compaction_proactive_order;
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+
+		if (order > 0)
+			timeout = msecs_to_jiffies(
+				sysctl_compaction_proactive_interval) << backoff;
+
+		if (wait_event_freezable_timeout(pgdat->kcompactd_wait,
+				pgdat->kcompactd_max_order ||
+				order != sysctl_compaction_proactive_order ||
+				kthread_should_stop(), timeout)) {
+			if (pgdat->kcompactd_max_order) {
+				kcompactd_do_work(pgdat);
+				backoff = 0;
+			}
+			continue;
+		}
+
+		if (kcompactd_proactive(pgdat, order))
+			backoff = min_t(unsigned int, backoff + 1,
+						KCOMPACTD_MAX_BACKOFF);
+		else
+			backoff = 0;
+	}
+
+	return 0;
+}
+
+void wakeup_kcompactd(pg_data_t *pgdat, int order)
+{
+	if (!order)
+		return;
+
+	if (pgdat->kcompactd_max_order < order)
+		pgdat->kcompactd_max_order = order;
+	if (!waitqueue_active(&pgdat->kcompactd_wait))
+		return;
+	wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+/*
+ * This kcompactd start function will be called by init and node-hot-add.
+ * On node-hot-add, kcompactd will moved to proper cpus if cpus are hot-added.
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		pgdat->kcompactd = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.  Caller must
+ * hold lock_memory_hotplug().
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
+
+/*
+ * As with kswapd, restore the node binding of kcompactd once one of the
+ * node's cpus comes back online.
+ */
+static int __devinit kcompactd_cpu_callback(struct notifier_block *nfb,
+				  unsigned long action, void *hcpu)
+{
+	int nid;
+
+	if (action == CPU_ONLINE || action == CPU_ONLINE_FROZEN) {
+		for_each_node_state(nid, N_HIGH_MEMORY) {
+			pg_data_t *pgdat = NODE_DATA(nid);
+			const struct cpumask *mask;
+
+			mask = cpumask_of_node(pgdat->node_id);
+
+			if (pgdat->kcompactd &&
+			    cpumask_any_and(cpu_online_mask, mask) < nr_cpu_ids)
+				/* One of our CPUs online: restore mask */
+				set_cpus_allowed_ptr(pgdat->kcompactd, mask);
+		}
+	}
+	return NOTIFY_OK;
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	hotcpu_notifier(kcompactd_cpu_callback, 0);
+	return 0;
+}
+
+module_init(kcompactd_init)
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct device *dev,
 			struct device_attribute *attr,
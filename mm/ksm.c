@@ -151,6 +151,9 @@ struct rmap_item {
 #define SEQNR_MASK	0x0ff	/* low bits of unstable tree seqnr */
 #define UNSTABLE_FLAG	0x100	/* is a node of the unstable tree */
 #define STABLE_FLAG	0x200	/* is listed from the stable tree */
+#define VOLATILE_SHIFT	10
+#define VOLATILE_MASK	0xc00	/* recent checksum changes, see below */
+#define VOLATILE_MAX	(VOLATILE_MASK >> VOLATILE_SHIFT)
 
 /* The stable and unstable tree heads */
 static struct rb_root root_stable_tree = RB_ROOT;
@@ -183,12 +186,36 @@ static unsigned long ksm_pages_unshared;
 /* The number of rmap_items in use: to calculate pages_volatile */
 static unsigned long ksm_rmap_items;
 
+/* The number of pages looked at, merged and skipped as volatile by ksmd */
+static unsigned long ksm_pages_scanned;
+static unsigned long ksm_pages_merged;
+static unsigned long ksm_pages_skipped;
+
+/* Pages merged per thousand scanned in the last full scan */
+static unsigned int ksm_scan_yield;
+
 /* Number of pages ksmd should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
 
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/*
+ * With adaptive_scan set, each full scan which merges less than
+ * KSM_YIELD_LOW pages per thousand doubles ksmd's sleep, up to
+ * 1 << KSM_MAX_BACKOFF times sleep_millisecs; a full scan merging at
+ * least KSM_YIELD_HIGH per thousand, or a new mm to scan, resets it.
+ */
+#define KSM_YIELD_LOW	1
+#define KSM_YIELD_HIGH	10
+#define KSM_MAX_BACKOFF	5
+static unsigned int ksm_adaptive_scan;
+static unsigned int ksm_scan_backoff;
+
+/* Number of threads, ksmd included, sharing the checksumming of a batch */
+#define KSM_MAX_SCAN_THREADS	16
+static unsigned int ksm_scan_threads = 1;
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
@@ -302,6 +329,11 @@ static inline int in_stable_tree(struct rmap_item *rmap_item)
 	return rmap_item->address & STABLE_FLAG;
 }
 
+static inline unsigned int rmap_item_volatility(struct rmap_item *rmap_item)
+{
+	return (rmap_item->address & VOLATILE_MASK) >> VOLATILE_SHIFT;
+}
+
 /*
  * ksmd, and unmerge_and_remove_all_rmap_items(), must not touch an mm's
  * page tables after it has passed through ksm_exit() - which, if necessary,
@@ -1171,8 +1203,10 @@ static void stable_tree_append(struct rmap_item *rmap_item,
  *
  * @page: the page that we are searching identical page to.
  * @rmap_item: the reverse mapping into the virtual address of this page
+ * @precomputed: checksum of the page if already calculated, or NULL
  */
-static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
+static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item,
+			       const u32 *precomputed)
 {
 	struct rmap_item *tree_rmap_item;
 	struct page *tree_page = NULL;
@@ -1195,6 +1229,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			lock_page(kpage);
 			stable_tree_append(rmap_item, page_stable_node(kpage));
 			unlock_page(kpage);
+			ksm_pages_merged++;
 		}
 		put_page(kpage);
 		return;
@@ -1205,12 +1240,17 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * we calculated it, this page is changing frequently: therefore we
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
+	 * Remember how many times in a row that has happened, so that
+	 * scan_volatile_rmap_item() can look at such pages less often.
 	 */
-	checksum = calc_checksum(page);
+	checksum = precomputed ? *precomputed : calc_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
+		if (rmap_item_volatility(rmap_item) < VOLATILE_MAX)
+			rmap_item->address += 1 << VOLATILE_SHIFT;
 		return;
 	}
+	rmap_item->address &= ~VOLATILE_MASK;
 
 	tree_rmap_item =
 		unstable_tree_search_insert(rmap_item, page, &tree_page);
@@ -1231,6 +1271,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			if (stable_node) {
 				stable_tree_append(tree_rmap_item, stable_node);
 				stable_tree_append(rmap_item, stable_node);
+				ksm_pages_merged++;
 			}
 			unlock_page(kpage);
 
@@ -1276,6 +1317,178 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
+/*
+ * A page whose checksum has changed on consecutive visits is not going to
+ * be merged any time soon: the VOLATILE bits of its rmap_item count those
+ * changes (saturating at VOLATILE_MAX), and once there have been two or
+ * more, ksmd looks at the page only every 2nd, then every 4th full scan,
+ * sparing both the stable tree search and the checksum.  A page found
+ * unchanged is at once looked at on every scan again.
+ *
+ * Such an rmap_item cannot be in the unstable tree, and one listed from
+ * the stable tree is never skipped, since visiting it is what unlinks it.
+ */
+static bool scan_volatile_rmap_item(struct rmap_item *rmap_item)
+{
+	unsigned int volatility = rmap_item_volatility(rmap_item);
+
+	if (volatility < 2 || in_stable_tree(rmap_item))
+		return true;
+	return !(ksm_scan.seqnr & ((1UL << (volatility - 1)) - 1));
+}
+
+/*
+ * With scan_threads above 1, ksmd collects up to KSM_SCAN_BATCH pages
+ * which need to be compared, has their checksums calculated by itself and
+ * its helper threads in parallel, then merges them one by one as before:
+ * the stable and unstable trees are still only ever touched by ksmd.
+ *
+ * Each page stays pinned until it is merged, so a batch is ended early by
+ * a page mapped more than once, lest a second pin of the same page make
+ * write_protect_page() refuse it; and it is always ended before ksmd
+ * moves on to the next mm_slot, since an exiting mm's rmap_items may be
+ * freed once the cursor has left its slot.  The batch is protected by
+ * ksm_thread_mutex, and is empty whenever ksmd drops that.
+ */
+#define KSM_SCAN_BATCH	128
+
+struct ksm_batch_entry {
+	struct rmap_item *rmap_item;
+	struct page *page;
+	u32 checksum;
+};
+
+static struct ksm_batch_entry ksm_batch[KSM_SCAN_BATCH];
+static unsigned int ksm_batch_nr;
+
+static bool ksm_helper_work[KSM_MAX_SCAN_THREADS - 1];
+static DECLARE_WAIT_QUEUE_HEAD(ksm_helper_wait);
+static DECLARE_COMPLETION(ksm_helper_done);
+static atomic_t ksm_helper_pending;
+
+static void ksm_checksum_slice(unsigned int slice)
+{
+	unsigned int i = ksm_batch_nr * slice / ksm_scan_threads;
+	unsigned int end = ksm_batch_nr * (slice + 1) / ksm_scan_threads;
+
+	for (; i < end; i++)
+		ksm_batch[i].checksum = calc_checksum(ksm_batch[i].page);
+}
+
+#ifdef CONFIG_SYSFS
+static struct task_struct *ksm_helpers[KSM_MAX_SCAN_THREADS - 1];
+
+static int ksm_helper_thread(void *data)
+{
+	long id = (long)data;
+
+	set_user_nice(current, 5);
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ksm_helper_wait,
+			ksm_helper_work[id] || kthread_should_stop());
+		if (!ksm_helper_work[id])
+			continue;
+		smp_rmb();	/* read ksm_batch after ksm_helper_work */
+		ksm_checksum_slice(id + 1);
+		ksm_helper_work[id] = false;
+		if (atomic_dec_and_test(&ksm_helper_pending))
+			complete(&ksm_helper_done);
+	}
+	return 0;
+}
+
+/*
+ * Start or stop helper threads so that nr threads, ksmd included, share
+ * the checksumming.  Only called through the sysfs control interface,
+ * with ksm_thread_mutex held, so never while a batch is in flight.
+ */
+static int ksm_set_scan_threads(unsigned int nr)
+{
+	struct task_struct *helper;
+	long id;
+
+	while (ksm_scan_threads > nr) {
+		id = --ksm_scan_threads - 1;
+		kthread_stop(ksm_helpers[id]);
+		ksm_helpers[id] = NULL;
+	}
+	while (ksm_scan_threads < nr) {
+		id = ksm_scan_threads - 1;
+		helper = kthread_run(ksm_helper_thread, (void *)id,
+				     "ksmd/%ld", id + 1);
+		if (IS_ERR(helper)) {
+			printk(KERN_ERR "ksm: creating kthread failed\n");
+			return PTR_ERR(helper);
+		}
+		ksm_helpers[id] = helper;
+		ksm_scan_threads++;
+	}
+	return 0;
+}
+#endif /* CONFIG_SYSFS */
+
+static void ksm_checksum_batch(void)
+{
+	unsigned int helpers = ksm_scan_threads - 1;
+	unsigned int i;
+
+	INIT_COMPLETION(ksm_helper_done);
+	atomic_set(&ksm_helper_pending, helpers);
+	smp_wmb();	/* publish ksm_batch before ksm_helper_work */
+	for (i = 0; i < helpers; i++)
+		ksm_helper_work[i] = true;
+	wake_up_all(&ksm_helper_wait);
+
+	ksm_checksum_slice(0);
+	wait_for_completion(&ksm_helper_done);
+}
+
+static void ksm_merge_batch(void)
+{
+	bool checksummed = ksm_scan_threads > 1;
+	unsigned int i;
+
+	if (!ksm_batch_nr)
+		return;
+	if (checksummed)
+		ksm_checksum_batch();
+
+	for (i = 0; i < ksm_batch_nr; i++) {
+		struct ksm_batch_entry *entry = &ksm_batch[i];
+
+		cmp_and_merge_page(entry->page, entry->rmap_item,
+				   checksummed ? &entry->checksum : NULL);
+		put_page(entry->page);
+	}
+	ksm_batch_nr = 0;
+}
+
+/*
+ * Called at the end of each full scan: note its merge yield and, if
+ * adaptive_scan is set, adjust ksm_scan_backoff accordingly.
+ */
+static void ksm_update_scan_yield(void)
+{
+	static unsigned long last_scanned, last_merged;
+	unsigned long scanned = ksm_pages_scanned - last_scanned;
+	unsigned long merged = ksm_pages_merged - last_merged;
+
+	last_scanned = ksm_pages_scanned;
+	last_merged = ksm_pages_merged;
+	ksm_scan_yield = scanned ? mult_frac(merged, 1000UL, scanned) : 0;
+
+	if (!ksm_adaptive_scan)
+		return;
+	if (ksm_scan_yield >= KSM_YIELD_HIGH)
+		ksm_scan_backoff = 0;
+	else if (ksm_scan_yield < KSM_YIELD_LOW) {
+		if (ksm_scan_backoff < KSM_MAX_BACKOFF)
+			ksm_scan_backoff++;
+	} else if (ksm_scan_backoff)
+		ksm_scan_backoff--;
+}
+
 static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 {
 	struct mm_struct *mm;
@@ -1318,6 +1531,7 @@ next_mm:
 	}
 
 	mm = slot->mm;
+rescan_mm:
 	down_read(&mm->mmap_sem);
 	if (ksm_test_exit(mm))
 		vma = NULL;
@@ -1362,6 +1576,16 @@ next_mm:
 		}
 	}
 
+	/*
+	 * Merge the batch before leaving this mm: merging takes mmap_sem
+	 * itself, so drop it, then look again for vmas made mergeable since.
+	 */
+	if (ksm_batch_nr) {
+		up_read(&mm->mmap_sem);
+		ksm_merge_batch();
+		goto rescan_mm;
+	}
+
 	if (ksm_test_exit(mm)) {
 		ksm_scan.address = 0;
 		ksm_scan.rmap_list = &slot->rmap_list;
@@ -1403,6 +1627,7 @@ next_mm:
 	if (slot != &ksm_mm_head)
 		goto next_mm;
 
+	ksm_update_scan_yield();
 	ksm_scan.seqnr++;
 	return NULL;
 }
@@ -1415,16 +1640,29 @@ static void ksm_do_scan(unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
+	unsigned int batch = ksm_scan_threads > 1 ? KSM_SCAN_BATCH : 1;
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
 		rmap_item = scan_get_next_rmap_item(&page);
 		if (!rmap_item)
-			return;
-		if (!PageKsm(page) || !in_stable_tree(rmap_item))
-			cmp_and_merge_page(page, rmap_item);
-		put_page(page);
+			break;
+		ksm_pages_scanned++;
+		if (PageKsm(page) && in_stable_tree(rmap_item)) {
+			put_page(page);
+			continue;
+		}
+		if (!scan_volatile_rmap_item(rmap_item)) {
+			ksm_pages_skipped++;
+			put_page(page);
+			continue;
+		}
+		ksm_batch[ksm_batch_nr].rmap_item = rmap_item;
+		ksm_batch[ksm_batch_nr].page = page;
+		if (++ksm_batch_nr == batch || page_mapcount(page) > 1)
+			ksm_merge_batch();
 	}
+	ksm_merge_batch();
 }
 
 static int ksmd_should_run(void)
@@ -1432,6 +1670,13 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
+static unsigned int ksm_sleep_millisecs(void)
+{
+	u64 msecs = (u64)ksm_thread_sleep_millisecs << ksm_scan_backoff;
+
+	return min_t(u64, msecs, UINT_MAX);
+}
+
 static int ksm_scan_thread(void *nothing)
 {
 	set_freezable();
@@ -1447,7 +1692,7 @@ static int ksm_scan_thread(void *nothing)
 
 		if (ksmd_should_run()) {
 			schedule_timeout_interruptible(
-				msecs_to_jiffies(ksm_thread_sleep_millisecs));
+				msecs_to_jiffies(ksm_sleep_millisecs()));
 		} else {
 			wait_event_freezable(ksm_thread_wait,
 				ksmd_should_run() || kthread_should_stop());
@@ -1524,6 +1769,9 @@ int __ksm_enter(struct mm_struct *mm)
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
 	atomic_inc(&mm->mm_count);
 
+	/* A new mm may have plenty to merge: stop backing off */
+	ksm_scan_backoff = 0;
+
 	if (needs_wakeup)
 		wake_up_interruptible(&ksm_thread_wait);
 
@@ -1926,6 +2174,55 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 KSM_ATTR(run);
 
+static ssize_t scan_threads_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_scan_threads);
+}
+
+static ssize_t scan_threads_store(struct kobject *kobj,
+				  struct kobj_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int err;
+	unsigned long nr_threads;
+
+	err = strict_strtoul(buf, 10, &nr_threads);
+	if (err || !nr_threads || nr_threads > KSM_MAX_SCAN_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&ksm_thread_mutex);
+	err = ksm_set_scan_threads(nr_threads);
+	mutex_unlock(&ksm_thread_mutex);
+
+	return err ? err : count;
+}
+KSM_ATTR(scan_threads);
+
+static ssize_t adaptive_scan_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_adaptive_scan);
+}
+
+static ssize_t adaptive_scan_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	int err;
+	unsigned long flag;
+
+	err = strict_strtoul(buf, 10, &flag);
+	if (err || flag > 1)
+		return -EINVAL;
+
+	ksm_adaptive_scan = flag;
+	ksm_scan_backoff = 0;
+
+	return count;
+}
+KSM_ATTR(adaptive_scan);
+
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
@@ -1971,15 +2268,49 @@ static ssize_t full_scans_show(struct kobject *kobj,
 }
 KSM_ATTR_RO(full_scans);
 
+static ssize_t pages_scanned_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_scanned);
+}
+KSM_ATTR_RO(pages_scanned);
+
+static ssize_t pages_merged_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_merged);
+}
+KSM_ATTR_RO(pages_merged);
+
+static ssize_t pages_skipped_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ksm_pages_skipped);
+}
+KSM_ATTR_RO(pages_skipped);
+
+static ssize_t scan_yield_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_scan_yield);
+}
+KSM_ATTR_RO(scan_yield);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
 	&run_attr.attr,
+	&scan_threads_attr.attr,
+	&adaptive_scan_attr.attr,
 	&pages_shared_attr.attr,
 	&pages_sharing_attr.attr,
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&pages_scanned_attr.attr,
+	&pages_merged_attr.attr,
+	&pages_skipped_attr.attr,
+	&scan_yield_attr.attr,
 	NULL,
 };
 
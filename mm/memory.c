@@ -3504,11 +3504,14 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		pmd_t orig_pmd = *pmd;
 		barrier();
 		if (pmd_trans_huge(orig_pmd)) {
-			if (flags & FAULT_FLAG_WRITE &&
-			    !pmd_write(orig_pmd) &&
+			unsigned int dirty = flags & FAULT_FLAG_WRITE;
+
+			if (dirty && !pmd_write(orig_pmd) &&
 			    !pmd_trans_splitting(orig_pmd))
 				return do_huge_pmd_wp_page(mm, vma, address,
 							   pmd, orig_pmd);
+			huge_pmd_set_accessed(mm, vma, address, pmd,
+					      orig_pmd, dirty);
 			return 0;
 		}
 	}
@@ -3534,6 +3537,179 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Walk to the pte mapping @address without allocating page tables.
+ * Called with interrupts disabled: page tables are only freed after an
+ * RCU-sched grace period (HAVE_RCU_TABLE_FREE) or an IPI, both of which
+ * that holds off.  The pmd value the pte was found through is returned
+ * in @pmdval, so that the caller can check it did not change.
+ */
+static pte_t *speculative_pte_map(struct mm_struct *mm, unsigned long address,
+				  pmd_t **pmdp, pmd_t *pmdval)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		return NULL;
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		return NULL;
+	pmd = pmd_offset(pud, address);
+	*pmdval = ACCESS_ONCE(*pmd);
+	if (pmd_none(*pmdval) || pmd_trans_huge(*pmdval) ||
+	    unlikely(pmd_bad(*pmdval)))
+		return NULL;
+	*pmdp = pmd;
+	return pte_offset_map(pmdval, address);
+}
+
+/*
+ * handle_speculative_fault - handle a page fault without mmap_sem
+ *
+ * Only the first touch of private anonymous memory is handled here, which
+ * is what threads growing their heaps fault on; everything else is left
+ * to handle_mm_fault() under mmap_sem.  The vma is found and pinned with
+ * get_vma(), which samples its vm_sequence under mm->mm_rb_lock.  Anything
+ * that changes what the fault depends on - the vma's bounds, flags or
+ * protection, its removal, or mremap() moving its page tables - bumps
+ * vm_sequence or mm->move_pt_seq with mmap_sem held for write, so the new
+ * pte is only set if neither has changed once the page table lock is held,
+ * and only while the vma is still in the rbtree.  Unmapping zaps the ptes
+ * under that same lock afterwards, so a pte set here before the vma went
+ * away is torn down with it.
+ *
+ * Returns 0 if the fault was handled, or VM_FAULT_RETRY if the caller
+ * must take mmap_sem and call handle_mm_fault().
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+			     unsigned int flags)
+{
+	struct vm_area_struct *vma;
+	unsigned long vm_flags;
+	pgprot_t vm_page_prot;
+	unsigned int seq, move_seq;
+	struct page *page = NULL;
+	pmd_t *pmd, pmdval;
+	pte_t *pte, entry;
+	spinlock_t *ptl;
+	int ret = VM_FAULT_RETRY;
+
+	address &= PAGE_MASK;
+
+	vma = get_vma(mm, address, &seq);
+	if (!vma)
+		return VM_FAULT_RETRY;
+
+	move_seq = raw_seqcount_begin(&mm->move_pt_seq);
+
+	vm_flags = vma->vm_flags;
+	vm_page_prot = vma->vm_page_prot;
+	if (address < vma->vm_start || address >= vma->vm_end)
+		goto out_put;
+	/* Only anonymous memory that has been faulted into before */
+	if (vma->vm_ops || vma->vm_file || !vma->anon_vma || vma_policy(vma))
+		goto out_put;
+	if (vm_flags & (VM_SHARED | VM_LOCKED | VM_GROWSDOWN | VM_GROWSUP |
+			VM_PFNMAP | VM_MIXEDMAP))
+		goto out_put;
+	if (!(vm_flags & ((flags & FAULT_FLAG_WRITE) ? VM_WRITE : VM_READ)))
+		goto out_put;
+	if (read_seqcount_retry(&vma->vm_sequence, seq))
+		goto out_put;
+
+	__set_current_state(TASK_RUNNING);
+	check_sync_rss_stat(current);
+
+	if (flags & FAULT_FLAG_WRITE) {
+		bool none = false;
+
+		/* Don't allocate for a COW fault or one that raced */
+		local_irq_disable();
+		pte = speculative_pte_map(mm, address, &pmd, &pmdval);
+		if (pte) {
+			none = pte_none(*pte);
+			pte_unmap(pte);
+		}
+		local_irq_enable();
+		if (!none)
+			goto out_put;
+
+		page = alloc_zeroed_user_highpage_movable(vma, address);
+		if (!page)
+			goto out_put;
+		__SetPageUptodate(page);
+		if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL)) {
+			page_cache_release(page);
+			goto out_put;
+		}
+		entry = mk_pte(page, vm_page_prot);
+		entry = pte_mkwrite(pte_mkdirty(entry));
+	} else
+		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
+					      vm_page_prot));
+
+	local_irq_disable();
+	pte = speculative_pte_map(mm, address, &pmd, &pmdval);
+	if (!pte)
+		goto out_irq;
+	ptl = pte_lockptr(mm, &pmdval);
+	/* The lock holder may be waiting for us to take a TLB flush IPI */
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		goto out_irq;
+	}
+	/* An erased vma has its rb node cleared */
+	if (pmd_val(*pmd) != pmd_val(pmdval) || RB_EMPTY_NODE(&vma->vm_rb) ||
+	    read_seqcount_retry(&vma->vm_sequence, seq) ||
+	    read_seqcount_retry(&mm->move_pt_seq, move_seq)) {
+		pte_unmap_unlock(pte, ptl);
+		goto out_irq;
+	}
+	/* The page table cannot be freed while we hold its lock */
+	local_irq_enable();
+
+	/*
+	 * Anything but an empty pte - a swap entry, or a present one that
+	 * may only need making young - is left to handle_mm_fault().
+	 */
+	if (!pte_none(*pte))
+		goto unlock;
+
+	ret = 0;
+
+	if (page) {
+		inc_mm_counter_fast(mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, vma, address);
+		page = NULL;
+	}
+	set_pte_at(mm, address, pte, entry);
+
+	/* No need to invalidate - it was non-present before */
+	update_mmu_cache(vma, address, pte);
+
+	count_vm_event(PGFAULT);
+	count_vm_event(SPECULATIVE_PGFAULT);
+	mem_cgroup_count_vm_event(mm, PGFAULT);
+unlock:
+	pte_unmap_unlock(pte, ptl);
+	goto out_page;
+out_irq:
+	local_irq_enable();
+out_page:
+	if (page) {
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+	}
+out_put:
+	put_vma(vma);
+	return ret;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
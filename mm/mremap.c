@@ -26,6 +26,26 @@
 
 #include "internal.h"
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static inline void move_pt_begin(struct mm_struct *mm)
+{
+	write_seqcount_begin(&mm->move_pt_seq);
+}
+
+static inline void move_pt_end(struct mm_struct *mm)
+{
+	write_seqcount_end(&mm->move_pt_seq);
+}
+#else
+static inline void move_pt_begin(struct mm_struct *mm)
+{
+}
+
+static inline void move_pt_end(struct mm_struct *mm)
+{
+}
+#endif
+
 static pmd_t *get_old_pmd(struct mm_struct *mm, unsigned long addr)
 {
 	pgd_t *pgd;
@@ -213,10 +233,17 @@ static unsigned long move_vma(struct vm_area_struct *vma,
 	if (err)
 		return err;
 
+	/*
+	 * A speculative fault must not populate the new range while its
+	 * page tables are being moved, nor the old range before it is gone.
+	 */
+	move_pt_begin(mm);
 	new_pgoff = vma->vm_pgoff + ((old_addr - vma->vm_start) >> PAGE_SHIFT);
 	new_vma = copy_vma(&vma, new_addr, new_len, new_pgoff);
-	if (!new_vma)
+	if (!new_vma) {
+		move_pt_end(mm);
 		return -ENOMEM;
+	}
 
 	moved_len = move_page_tables(vma, old_addr, new_vma, new_addr, old_len);
 	if (moved_len < old_len) {
@@ -269,6 +296,7 @@ static unsigned long move_vma(struct vm_area_struct *vma,
 		excess = 0;
 	}
 	mm->hiwater_vm = hiwater_vm;
+	move_pt_end(mm);
 
 	/* Restore VM_ACCOUNT if one or two pieces of vma left */
 	if (excess) {
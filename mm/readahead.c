@@ -321,12 +321,25 @@ static unsigned long get_next_ra_size(struct file_ra_state *ra,
  * indicator. The flag won't be set on already cached pages, to avoid the
  * readahead-for-nothing fuss, saving pointless page cache lookups.
  *
+ * Interleaved streams are also tracked explicitly: when a new window
+ * replaces one that belongs to another stream, the old window is kept in
+ * ra->streams[], and an access at the expected offset of one of those
+ * windows switches back to it and ramps it up as if the stream had never
+ * been interrupted. The page cache probes below remain as a fallback for
+ * more streams than fit in ra->streams[].
+ *
  * prev_pos tracks the last visited byte in the _previous_ read request.
  * It should be maintained by the caller, and will be used for detecting
  * small random reads. Note that the readahead algorithm checks loosely
  * for sequential patterns. Hence interleaved reads might be served as
  * sequential ones.
  *
+ * Small random reads that keep the same distance from each other (such
+ * as one field of fixed size records) are detected as strided, and a few
+ * strides are read ahead once the distance has repeated RA_STRIDE_MIN
+ * times. The middle chunk is marked with PG_readahead to keep them
+ * pipelined.
+ *
  * There is a special-case: if the first page which the application tries to
  * read happens to be the first page of the file, it is assumed that a linear
  * read is about to happen and the window is immediately set to the initial size
@@ -336,6 +349,147 @@ static unsigned long get_next_ra_size(struct file_ra_state *ra,
  * it approaches max_readhead.
  */
 
+/*
+ * Is @offset where the stream that owns window @w goes on, i.e. at its
+ * readahead marker or right past its end?
+ */
+static bool ra_window_next(struct file_ra_window *w, pgoff_t offset)
+{
+	return w->size && (offset == w->start + w->size - w->async_size ||
+			   offset == w->start + w->size);
+}
+
+/*
+ * The current window is about to be replaced with one starting at
+ * @offset. Unless that continues the same stream, remember it as the
+ * most recently used of the other streams.
+ */
+static void ra_push_stream(struct file_ra_state *ra, pgoff_t offset)
+{
+	if (!ra->size ||
+	    (offset >= ra->start && offset <= ra->start + ra->size))
+		return;
+
+	memmove(&ra->streams[1], &ra->streams[0],
+		(RA_NR_STREAMS - 1) * sizeof(ra->streams[0]));
+	ra->streams[0].start = ra->start;
+	ra->streams[0].size = ra->size;
+	ra->streams[0].async_size = ra->async_size;
+}
+
+/*
+ * If @offset continues one of the other streams of this file, make that
+ * stream's window the current one and move the current window to the
+ * front of ra->streams[].
+ */
+static bool ra_find_stream(struct file_ra_state *ra, pgoff_t offset)
+{
+	struct file_ra_window w;
+	int i;
+
+	for (i = 0; i < RA_NR_STREAMS; i++) {
+		if (ra_window_next(&ra->streams[i], offset))
+			break;
+	}
+	if (i == RA_NR_STREAMS)
+		return false;
+
+	w = ra->streams[i];
+	memmove(&ra->streams[1], &ra->streams[0], i * sizeof(w));
+	ra->streams[0].start = ra->start;
+	ra->streams[0].size = ra->size;
+	ra->streams[0].async_size = ra->async_size;
+	ra->start = w.start;
+	ra->size = w.size;
+	ra->async_size = w.async_size;
+
+	count_vm_event(READAHEAD_STREAM);
+	return true;
+}
+
+/*
+ * A stride has to repeat this many times before it is read ahead, and at
+ * most RA_STRIDE_CHUNKS strides are read ahead at once.
+ */
+#define RA_STRIDE_MIN		2
+#define RA_STRIDE_CHUNKS	8
+
+/*
+ * Read ahead chunks of @req_size pages ra->stride pages apart, following
+ * the one at ra->stride_prev.
+ */
+static unsigned long stride_readahead(struct address_space *mapping,
+				      struct file_ra_state *ra,
+				      struct file *filp,
+				      unsigned long req_size,
+				      unsigned long max)
+{
+	loff_t isize = i_size_read(mapping->host);
+	unsigned long nr_chunks, i, ret = 0;
+	long index = ra->stride_prev;
+
+	if (!isize || !req_size)
+		return 0;
+
+	nr_chunks = clamp_t(unsigned long, max / req_size, 1, RA_STRIDE_CHUNKS);
+	for (i = 1; i <= nr_chunks; i++) {
+		index += ra->stride;
+		if (index < 0 ||
+		    index > ((isize - 1) >> PAGE_CACHE_SHIFT))
+			break;
+		ret += __do_page_cache_readahead(mapping, filp, index, req_size,
+				i == (nr_chunks + 1) / 2 ? req_size : 0);
+		ra->stride_prev = index;
+	}
+
+	count_vm_event(READAHEAD_STRIDE);
+	return ret;
+}
+
+/*
+ * Is @offset one of the chunks stride_readahead() marked PG_readahead?
+ */
+static bool ra_stride_marker(struct file_ra_state *ra, pgoff_t offset)
+{
+	long distance = (long)(ra->stride_prev - offset);
+
+	if (ra->stride_count < RA_STRIDE_MIN)
+		return false;
+
+	return distance % ra->stride == 0 && distance / ra->stride > 0 &&
+	       distance / ra->stride <= RA_STRIDE_CHUNKS;
+}
+
+/*
+ * Standalone, small random read. Read as is, and do not pollute the
+ * readahead state, unless it is the same distance away from the previous
+ * one as that one was from its predecessor.
+ */
+static unsigned long random_readahead(struct address_space *mapping,
+				      struct file_ra_state *ra,
+				      struct file *filp, pgoff_t offset,
+				      unsigned long req_size,
+				      unsigned long max)
+{
+	long stride = (long)(offset - ra->stride_prev);
+	unsigned long ret;
+
+	if (stride == ra->stride && (unsigned long)abs(stride) > req_size) {
+		if (ra->stride_count < RA_STRIDE_MIN)
+			ra->stride_count++;
+	} else {
+		ra->stride = stride;
+		ra->stride_count = 0;
+	}
+	ra->stride_prev = offset;
+
+	ret = __do_page_cache_readahead(mapping, filp, offset, req_size, 0);
+	if (ra->stride_count >= RA_STRIDE_MIN)
+		ret += stride_readahead(mapping, ra, filp, req_size, max);
+
+	return ret;
+}
+
 /*
  * Count contiguously cached pages from @offset-1 to @offset-@max,
  * this count is a conservative estimation of
@@ -382,6 +536,7 @@ static int try_context_readahead(struct address_space *mapping,
 	if (size >= offset)
 		size *= 2;
 
+	ra_push_stream(ra, offset);
 	ra->start = offset;
 	ra->size = get_init_ra_size(size + req_size, max);
 	ra->async_size = ra->size;
@@ -407,11 +562,13 @@ ondemand_readahead(struct address_space *mapping,
 		goto initial_readahead;
 
 	/*
-	 * It's the expected callback offset, assume sequential access.
+	 * It's the expected callback offset of this or one of the other
+	 * streams, assume sequential access.
 	 * Ramp up sizes, and push forward the readahead window.
 	 */
 	if ((offset == (ra->start + ra->size - ra->async_size) ||
-	     offset == (ra->start + ra->size))) {
+	     offset == (ra->start + ra->size)) ||
+	    ra_find_stream(ra, offset)) {
 		ra->start += ra->size;
 		ra->size = get_next_ra_size(ra, max);
 		ra->async_size = ra->size;
@@ -427,6 +584,10 @@ ondemand_readahead(struct address_space *mapping,
 	if (hit_readahead_marker) {
 		pgoff_t start;
 
+		if (ra_stride_marker(ra, offset))
+			return stride_readahead(mapping, ra, filp, req_size,
+						max);
+
 		rcu_read_lock();
 		start = radix_tree_next_hole(&mapping->page_tree, offset+1,max);
 		rcu_read_unlock();
@@ -434,6 +595,7 @@ ondemand_readahead(struct address_space *mapping,
 		if (!start || start - offset > max)
 			return 0;
 
+		ra_push_stream(ra, offset);
 		ra->start = start;
 		ra->size = start - offset;	/* old async_size */
 		ra->size += req_size;
@@ -462,17 +624,24 @@ ondemand_readahead(struct address_space *mapping,
 		goto readit;
 
 	/*
-	 * standalone, small random read
-	 * Read as is, and do not pollute the readahead state.
+	 * standalone, small random read, possibly strided
 	 */
-	return __do_page_cache_readahead(mapping, filp, offset, req_size, 0);
+	return random_readahead(mapping, ra, filp, offset, req_size, max);
 
 initial_readahead:
+	ra_push_stream(ra, offset);
 	ra->start = offset;
 	ra->size = get_init_ra_size(req_size, max);
 	ra->async_size = ra->size > req_size ? ra->size - req_size : ra->size;
 
 readit:
+	/*
+	 * The reader went sequential: forget any stride, lest a stale one
+	 * claim a later PG_readahead hit in ra_stride_marker().
+	 */
+	ra->stride = 0;
+	ra->stride_count = 0;
+
 	/*
 	 * Will this read hit the readahead marker made by itself?
 	 * If so, trigger the readahead marker hit now, and merge
@@ -515,6 +684,7 @@ void page_cache_sync_readahead(struct address_space *mapping,
 	}
 
 	/* do read-ahead */
+	count_vm_event(READAHEAD_MISS);
 	ondemand_readahead(mapping, ra, filp, false, offset, req_size);
 }
 EXPORT_SYMBOL_GPL(page_cache_sync_readahead);
@@ -551,6 +721,7 @@ page_cache_async_readahead(struct address_space *mapping,
 		return;
 
 	ClearPageReadahead(page);
+	count_vm_event(READAHEAD_HIT);
 
 	/*
 	 * Defer asynchronous read-ahead on IO congestion.
@@ -36,7 +36,21 @@
 /* How many pages do we try to swap or page in/out together? */
 int page_cluster;
 
-static DEFINE_PER_CPU(struct pagevec[NR_LRU_LISTS], lru_add_pvecs);
+/*
+ * New pages are queued for the LRU lists in per-cpu batches, with the list
+ * they go to decided by their page flags only when the batch is drained.
+ * One batch for all lists, and a larger one than a pagevec, means that
+ * zone->lru_lock is taken far less often by tasks faulting in or reading
+ * pages.
+ */
+#define LRU_ADD_BATCH	(4 * PAGEVEC_SIZE)
+
+struct lru_add_batch {
+	unsigned int nr;
+	struct page *pages[LRU_ADD_BATCH];
+};
+
+static DEFINE_PER_CPU(struct lru_add_batch, lru_add_batches);
 static DEFINE_PER_CPU(struct pagevec, lru_rotate_pvecs);
 static DEFINE_PER_CPU(struct pagevec, lru_deactivate_pvecs);
 
@@ -371,14 +385,66 @@ void mark_page_accessed(struct page *page)
 }
 EXPORT_SYMBOL(mark_page_accessed);
 
+static void lru_add_page(struct zone *zone, struct page *page,
+			 enum lru_list lru)
+{
+	SetPageLRU(page);
+	add_page_to_lru_list(zone, page, lru);
+	update_page_reclaim_stat(zone, page, is_file_lru(lru),
+				 is_active_lru(lru));
+}
+
+/*
+ * Put the pages of @batch on the LRU lists that their flags select, then
+ * drop the references __lru_cache_add() took on them.
+ */
+static void lru_add_batch_drain(struct lru_add_batch *batch)
+{
+	struct zone *zone = NULL;
+	unsigned long flags = 0;
+	unsigned int i;
+
+	for (i = 0; i < batch->nr; i++) {
+		struct page *page = batch->pages[i];
+		struct zone *pagezone = page_zone(page);
+
+		if (pagezone != zone) {
+			if (zone)
+				spin_unlock_irqrestore(&zone->lru_lock, flags);
+			zone = pagezone;
+			spin_lock_irqsave(&zone->lru_lock, flags);
+		}
+
+		VM_BUG_ON(PageUnevictable(page));
+		VM_BUG_ON(PageLRU(page));
+		lru_add_page(zone, page, page_lru(page));
+	}
+	if (zone)
+		spin_unlock_irqrestore(&zone->lru_lock, flags);
+	release_pages(batch->pages, batch->nr, 0);
+	batch->nr = 0;
+}
+
+/*
+ * Queue @page for @lru.  The list is only chosen when the batch is
+ * drained, by page_lru(), so apart from PG_active, which is set here,
+ * @lru must already agree with the page's flags: anon lists for
+ * PageSwapBacked pages, file lists for the others.
+ */
 void __lru_cache_add(struct page *page, enum lru_list lru)
 {
-	struct pagevec *pvec = &get_cpu_var(lru_add_pvecs)[lru];
+	struct lru_add_batch *batch = &get_cpu_var(lru_add_batches);
+
+	VM_BUG_ON(is_unevictable_lru(lru));
+	if (is_active_lru(lru))
+		SetPageActive(page);
+	VM_BUG_ON(page_lru(page) != lru);
 
 	page_cache_get(page);
-	if (!pagevec_add(pvec, page))
-		__pagevec_lru_add(pvec, lru);
-	put_cpu_var(lru_add_pvecs);
+	batch->pages[batch->nr++] = page;
+	if (batch->nr == LRU_ADD_BATCH)
+		lru_add_batch_drain(batch);
+	put_cpu_var(lru_add_batches);
 }
 EXPORT_SYMBOL(__lru_cache_add);
 
@@ -498,15 +564,11 @@ static void lru_deactivate_fn(struct page *page, void *arg)
  */
 void lru_add_drain_cpu(int cpu)
 {
-	struct pagevec *pvecs = per_cpu(lru_add_pvecs, cpu);
+	struct lru_add_batch *batch = &per_cpu(lru_add_batches, cpu);
 	struct pagevec *pvec;
-	int lru;
 
-	for_each_lru(lru) {
-		pvec = &pvecs[lru - LRU_BASE];
-		if (pagevec_count(pvec))
-			__pagevec_lru_add(pvec, lru);
-	}
+	if (batch->nr)
+		lru_add_batch_drain(batch);
 
 	pvec = &per_cpu(lru_rotate_pvecs, cpu);
 	if (pagevec_count(pvec)) {
@@ -702,18 +764,14 @@ static void __pagevec_lru_add_fn(struct page *page, void *arg)
 {
 	enum lru_list lru = (enum lru_list)arg;
 	struct zone *zone = page_zone(page);
-	int file = is_file_lru(lru);
-	int active = is_active_lru(lru);
 
 	VM_BUG_ON(PageActive(page));
 	VM_BUG_ON(PageUnevictable(page));
 	VM_BUG_ON(PageLRU(page));
 
-	SetPageLRU(page);
-	if (active)
+	if (is_active_lru(lru))
 		SetPageActive(page);
-	add_page_to_lru_list(zone, page, lru);
-	update_page_reclaim_stat(zone, page, file, active);
+	lru_add_page(zone, page, lru);
 }
 
 /*
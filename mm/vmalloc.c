@@ -27,6 +27,7 @@
 #include <linux/pfn.h>
 #include <linux/kmemleak.h>
 #include <linux/atomic.h>
+#include <linux/llist.h>
 #include <asm/uaccess.h>
 #include <asm/tlbflush.h>
 #include <asm/shmparam.h>
@@ -253,9 +254,14 @@ struct vmap_area {
 	unsigned long va_start;
 	unsigned long va_end;
 	unsigned long flags;
+	unsigned long gap;		/* free space just below va_start */
+	unsigned long subtree_max_gap;	/* largest gap in this subtree */
 	struct rb_node rb_node;		/* address sorted rbtree */
 	struct list_head list;		/* address sorted list */
-	struct list_head purge_list;	/* "lazy purge" list */
+	union {
+		struct llist_node purge_list;	/* "lazy purge" list */
+		struct list_head cache_list;	/* per-cpu area cache */
+	};
 	struct vm_struct *vm;
 	struct rcu_head rcu_head;
 };
@@ -263,15 +269,28 @@ struct vmap_area {
 static DEFINE_SPINLOCK(vmap_area_lock);
 static LIST_HEAD(vmap_area_list);
 static struct rb_root vmap_area_root = RB_ROOT;
-
-/* The vmap cache globals are protected by vmap_area_lock */
-static struct rb_node *free_vmap_cache;
-static unsigned long cached_hole_size;
-static unsigned long cached_vstart;
-static unsigned long cached_align;
+static LLIST_HEAD(vmap_purge_list);
 
 static unsigned long vmap_area_pcpu_hole;
 
+/*
+ * Small vmalloc areas are recycled through per-cpu caches once their lazy
+ * TLB flush has been done, so that the common vmalloc()/vfree() churn does
+ * not need the global vmap_area_lock at all.  Cached areas stay in the
+ * rbtree; they are handed back to the allocator when it runs short of
+ * space (see __purge_vmap_area_lazy()).
+ */
+#define VMAP_CACHE_CLASSES	8	/* areas of 1 to 8 pages, guard included */
+#define VMAP_CACHE_DEPTH	4
+
+struct vmap_area_cache {
+	spinlock_t lock;
+	unsigned int nr[VMAP_CACHE_CLASSES];
+	struct list_head free[VMAP_CACHE_CLASSES];
+};
+
+static DEFINE_PER_CPU(struct vmap_area_cache, vmap_area_cache);
+
 static struct vmap_area *__find_vmap_area(unsigned long addr)
 {
 	struct rb_node *n = vmap_area_root.rb_node;
@@ -291,11 +310,41 @@ static struct vmap_area *__find_vmap_area(unsigned long addr)
 	return NULL;
 }
 
+static inline unsigned long subtree_max_gap(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct vmap_area, rb_node)->subtree_max_gap : 0;
+}
+
+/*
+ * Each vmap_area records the hole between its predecessor and itself, and
+ * the largest such hole in its subtree.  This lets alloc_vmap_area() skip
+ * whole subtrees which cannot satisfy a request.
+ */
+static void vmap_area_augment_cb(struct rb_node *n, void *unused)
+{
+	struct vmap_area *va = rb_entry(n, struct vmap_area, rb_node);
+	unsigned long max_gap = va->gap;
+
+	max_gap = max(max_gap, subtree_max_gap(n->rb_left));
+	max_gap = max(max_gap, subtree_max_gap(n->rb_right));
+	va->subtree_max_gap = max_gap;
+}
+
+/* The gap of @n has changed, fix up the maxima of all its ancestors */
+static void vmap_area_propagate(struct rb_node *n)
+{
+	while (n) {
+		vmap_area_augment_cb(n, NULL);
+		n = rb_parent(n);
+	}
+}
+
 static void __insert_vmap_area(struct vmap_area *va)
 {
 	struct rb_node **p = &vmap_area_root.rb_node;
 	struct rb_node *parent = NULL;
 	struct rb_node *tmp;
+	struct vmap_area *prev = NULL;
 
 	while (*p) {
 		struct vmap_area *tmp_va;
@@ -316,15 +365,141 @@ static void __insert_vmap_area(struct vmap_area *va)
 	/* address-sort this list so it is usable like the vmlist */
 	tmp = rb_prev(&va->rb_node);
 	if (tmp) {
-		struct vmap_area *prev;
 		prev = rb_entry(tmp, struct vmap_area, rb_node);
 		list_add_rcu(&va->list, &prev->list);
 	} else
 		list_add_rcu(&va->list, &vmap_area_list);
+
+	va->gap = va->va_start - (prev ? prev->va_end : 0);
+	rb_augment_insert(&va->rb_node, vmap_area_augment_cb, NULL);
+
+	/* we have split the hole below our successor */
+	tmp = rb_next(&va->rb_node);
+	if (tmp) {
+		struct vmap_area *next = rb_entry(tmp, struct vmap_area, rb_node);
+
+		next->gap = next->va_start - va->va_end;
+		vmap_area_propagate(tmp);
+	}
+}
+
+/*
+ * Find the lowest address in [vstart, vend) where @size bytes fit at the
+ * given alignment.  Subtrees whose largest hole is smaller than @size are
+ * skipped, so this is O(log n) unless alignment makes many holes unusable.
+ */
+static unsigned long __find_vmap_hole(unsigned long size, unsigned long align,
+				      unsigned long vstart, unsigned long vend)
+{
+	struct rb_node *n = vmap_area_root.rb_node;
+	struct rb_node *last;
+	struct vmap_area *va;
+	unsigned long addr, hole_start;
+
+	while (n) {
+		va = rb_entry(n, struct vmap_area, rb_node);
+		/* holes in the left subtree all end below va_start */
+		if (va->va_start > vstart &&
+		    subtree_max_gap(n->rb_left) >= size) {
+			n = n->rb_left;
+			continue;
+		}
+check:
+		hole_start = va->va_start - va->gap;
+		if (hole_start >= vend)
+			return vend;
+		if (va->gap >= size) {
+			addr = ALIGN(max(hole_start, vstart), align);
+			if (addr >= hole_start && addr + size > addr &&
+			    addr + size <= va->va_start)
+				return addr;
+		}
+		if (subtree_max_gap(n->rb_right) >= size) {
+			n = n->rb_right;
+			continue;
+		}
+		/* climb up until we come back from a left subtree */
+		for (;;) {
+			struct rb_node *parent = rb_parent(n);
+
+			if (!parent)
+				goto tail;
+			if (parent->rb_left == n) {
+				n = parent;
+				va = rb_entry(n, struct vmap_area, rb_node);
+				goto check;
+			}
+			n = parent;
+		}
+	}
+
+tail:
+	/* the hole above the highest area */
+	last = rb_last(&vmap_area_root);
+	hole_start = last ? rb_entry(last, struct vmap_area, rb_node)->va_end : 0;
+	addr = ALIGN(max(hole_start, vstart), align);
+	if (addr < hole_start || addr + size < addr)
+		return vend;
+	return addr;
 }
 
 static void purge_vmap_area_lazy(void);
 
+static struct vmap_area *vmap_cache_get(unsigned long size,
+				unsigned long align,
+				unsigned long vstart, unsigned long vend)
+{
+	unsigned long idx = (size >> PAGE_SHIFT) - 1;
+	struct vmap_area_cache *vc;
+	struct vmap_area *va = NULL;
+
+	if (idx >= VMAP_CACHE_CLASSES || align > PAGE_SIZE ||
+	    vstart != VMALLOC_START || vend != VMALLOC_END)
+		return NULL;
+
+	vc = &get_cpu_var(vmap_area_cache);
+	spin_lock(&vc->lock);
+	if (vc->nr[idx]) {
+		va = list_first_entry(&vc->free[idx], struct vmap_area,
+				      cache_list);
+		list_del(&va->cache_list);
+		vc->nr[idx]--;
+	}
+	spin_unlock(&vc->lock);
+	put_cpu_var(vmap_area_cache);
+
+	return va;
+}
+
+/*
+ * Keep a purged area (unmapped and TLB flushed) for reuse on this cpu.
+ * Returns false if it has to be freed instead.
+ */
+static bool vmap_cache_put(struct vmap_area *va)
+{
+	unsigned long idx = ((va->va_end - va->va_start) >> PAGE_SHIFT) - 1;
+	struct vmap_area_cache *vc;
+	bool cached = false;
+
+	if (idx >= VMAP_CACHE_CLASSES ||
+	    va->va_start < VMALLOC_START || va->va_end > VMALLOC_END)
+		return false;
+
+	vc = &get_cpu_var(vmap_area_cache);
+	spin_lock(&vc->lock);
+	if (vc->nr[idx] < VMAP_CACHE_DEPTH) {
+		va->flags = 0;
+		va->vm = NULL;
+		list_add(&va->cache_list, &vc->free[idx]);
+		vc->nr[idx]++;
+		cached = true;
+	}
+	spin_unlock(&vc->lock);
+	put_cpu_var(vmap_area_cache);
+
+	return cached;
+}
+
 /*
  * Allocate a region of KVA of the specified size and alignment, within the
  * vstart and vend.
@@ -335,15 +510,17 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 				int node, gfp_t gfp_mask)
 {
 	struct vmap_area *va;
-	struct rb_node *n;
 	unsigned long addr;
 	int purged = 0;
-	struct vmap_area *first;
 
 	BUG_ON(!size);
 	BUG_ON(size & ~PAGE_MASK);
 	BUG_ON(!is_power_of_2(align));
 
+	va = vmap_cache_get(size, align, vstart, vend);
+	if (va)
+		return va;
+
 	va = kmalloc_node(sizeof(struct vmap_area),
 			gfp_mask & GFP_RECLAIM_MASK, node);
 	if (unlikely(!va))
@@ -351,84 +528,14 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 
 retry:
 	spin_lock(&vmap_area_lock);
-	/*
-	 * Invalidate cache if we have more permissive parameters.
-	 * cached_hole_size notes the largest hole noticed _below_
-	 * the vmap_area cached in free_vmap_cache: if size fits
-	 * into that hole, we want to scan from vstart to reuse
-	 * the hole instead of allocating above free_vmap_cache.
-	 * Note that __free_vmap_area may update free_vmap_cache
-	 * without updating cached_hole_size or cached_align.
-	 */
-	if (!free_vmap_cache ||
-			size < cached_hole_size ||
-			vstart < cached_vstart ||
-			align < cached_align) {
-nocache:
-		cached_hole_size = 0;
-		free_vmap_cache = NULL;
-	}
-	/* record if we encounter less permissive parameters */
-	cached_vstart = vstart;
-	cached_align = align;
-
-	/* find starting point for our search */
-	if (free_vmap_cache) {
-		first = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-		addr = ALIGN(first->va_end, align);
-		if (addr < vstart)
-			goto nocache;
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-	} else {
-		addr = ALIGN(vstart, align);
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-		n = vmap_area_root.rb_node;
-		first = NULL;
-
-		while (n) {
-			struct vmap_area *tmp;
-			tmp = rb_entry(n, struct vmap_area, rb_node);
-			if (tmp->va_end >= addr) {
-				first = tmp;
-				if (tmp->va_start <= addr)
-					break;
-				n = n->rb_left;
-			} else
-				n = n->rb_right;
-		}
-
-		if (!first)
-			goto found;
-	}
-
-	/* from the starting point, walk areas until a suitable hole is found */
-	while (addr + size > first->va_start && addr + size <= vend) {
-		if (addr + cached_hole_size < first->va_start)
-			cached_hole_size = first->va_start - addr;
-		addr = ALIGN(first->va_end, align);
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-		n = rb_next(&first->rb_node);
-		if (n)
-			first = rb_entry(n, struct vmap_area, rb_node);
-		else
-			goto found;
-	}
-
-found:
-	if (addr + size > vend)
+	addr = __find_vmap_hole(size, align, vstart, vend);
+	if (addr + size > vend || addr + size < addr)
 		goto overflow;
 
 	va->va_start = addr;
 	va->va_end = addr + size;
 	va->flags = 0;
 	__insert_vmap_area(va);
-	free_vmap_cache = &va->rb_node;
 	spin_unlock(&vmap_area_lock);
 
 	BUG_ON(va->va_start & (align-1));
@@ -454,27 +561,27 @@ overflow:
 
 static void __free_vmap_area(struct vmap_area *va)
 {
+	struct rb_node *next;
+	struct rb_node *deepest;
+
 	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
 
-	if (free_vmap_cache) {
-		if (va->va_end < cached_vstart) {
-			free_vmap_cache = NULL;
-		} else {
-			struct vmap_area *cache;
-			cache = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-			if (va->va_start <= cache->va_start) {
-				free_vmap_cache = rb_prev(&va->rb_node);
-				/*
-				 * We don't try to update cached_hole_size or
-				 * cached_align, but it won't go very wrong.
-				 */
-			}
-		}
-	}
+	next = rb_next(&va->rb_node);
+	deepest = rb_augment_erase_begin(&va->rb_node);
 	rb_erase(&va->rb_node, &vmap_area_root);
+	rb_augment_erase_end(deepest, vmap_area_augment_cb, NULL);
 	RB_CLEAR_NODE(&va->rb_node);
 	list_del_rcu(&va->list);
 
+	/* our successor inherits the hole below us */
+	if (next) {
+		struct vmap_area *next_va = rb_entry(next, struct vmap_area,
+						     rb_node);
+
+		next_va->gap += va->gap + (va->va_end - va->va_start);
+		vmap_area_propagate(next);
+	}
+
 	/*
 	 * Track the highest possible candidate for pcpu area
 	 * allocation.  Areas outside of vmalloc area can be returned
@@ -487,6 +594,34 @@ static void __free_vmap_area(struct vmap_area *va)
 	kfree_rcu(va, rcu_head);
 }
 
+/*
+ * Return the areas held in the per-cpu caches to the allocator.  Called
+ * with vmap_area_lock held.
+ */
+static void __vmap_cache_drain(void)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct vmap_area_cache *vc = &per_cpu(vmap_area_cache, cpu);
+
+		spin_lock(&vc->lock);
+		for (i = 0; i < VMAP_CACHE_CLASSES; i++) {
+			struct vmap_area *va, *n_va;
+
+			if (!vc->nr[i])
+				continue;
+			list_for_each_entry_safe(va, n_va, &vc->free[i],
+						 cache_list) {
+				list_del(&va->cache_list);
+				__free_vmap_area(va);
+			}
+			vc->nr[i] = 0;
+		}
+		spin_unlock(&vc->lock);
+	}
+}
+
 /*
  * Free a region of KVA allocated by alloc_vmap_area
  */
@@ -553,6 +688,9 @@ static unsigned long lazy_max_pages(void)
 
 static atomic_t vmap_lazy_nr = ATOMIC_INIT(0);
 
+/* number of areas freed per hold of vmap_area_lock when purging */
+#define VMAP_PURGE_BATCH	32
+
 /* for per-CPU blocks */
 static void purge_fragmented_blocks_allcpus(void);
 
@@ -568,7 +706,9 @@ void set_iounmap_nonlazy(void)
 /*
  * Purges all lazily-freed vmap areas.
  *
- * If sync is 0 then don't purge if there is already a purge in progress.
+ * If sync is 0 then don't purge if there is already a purge in progress,
+ * and keep small purged areas in the per-cpu caches.  If sync is 1, the
+ * per-cpu caches are emptied as well.
  * If force_flush is 1, then flush kernel TLBs between *start and *end even
  * if we found no lazy vmap areas to unmap (callers can use this to optimise
  * their own TLB flushing).
@@ -579,10 +719,10 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 					int sync, int force_flush)
 {
 	static DEFINE_SPINLOCK(purge_lock);
-	LIST_HEAD(valist);
+	struct llist_node *valist, *next;
 	struct vmap_area *va;
-	struct vmap_area *n_va;
 	int nr = 0;
+	int batch = 0;
 
 	/*
 	 * If sync is 0 but force_flush is 1, we'll go sync anyway but callers
@@ -598,20 +738,18 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	if (sync)
 		purge_fragmented_blocks_allcpus();
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(va, &vmap_area_list, list) {
-		if (va->flags & VM_LAZY_FREE) {
-			if (va->va_start < *start)
-				*start = va->va_start;
-			if (va->va_end > *end)
-				*end = va->va_end;
-			nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
-			list_add_tail(&va->purge_list, &valist);
-			va->flags |= VM_LAZY_FREEING;
-			va->flags &= ~VM_LAZY_FREE;
-		}
+	/* only the lazily freed areas are on the purge list */
+	valist = llist_del_all(&vmap_purge_list);
+	for (next = valist; next; next = llist_next(next)) {
+		va = llist_entry(next, struct vmap_area, purge_list);
+		if (va->va_start < *start)
+			*start = va->va_start;
+		if (va->va_end > *end)
+			*end = va->va_end;
+		nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
+		va->flags |= VM_LAZY_FREEING;
+		va->flags &= ~VM_LAZY_FREE;
 	}
-	rcu_read_unlock();
 
 	if (nr)
 		atomic_sub(nr, &vmap_lazy_nr);
@@ -619,10 +757,24 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	if (nr || force_flush)
 		flush_tlb_kernel_range(*start, *end);
 
-	if (nr) {
+	if (nr || sync) {
 		spin_lock(&vmap_area_lock);
-		list_for_each_entry_safe(va, n_va, &valist, purge_list)
+		for (; valist; valist = next) {
+			next = llist_next(valist);
+			va = llist_entry(valist, struct vmap_area, purge_list);
+			if (!sync && vmap_cache_put(va))
+				continue;
 			__free_vmap_area(va);
+			/* don't hold off allocators for the whole batch */
+			if (++batch >= VMAP_PURGE_BATCH) {
+				spin_unlock(&vmap_area_lock);
+				cpu_relax();
+				spin_lock(&vmap_area_lock);
+				batch = 0;
+			}
+		}
+		if (sync)
+			__vmap_cache_drain();
 		spin_unlock(&vmap_area_lock);
 	}
 	spin_unlock(&purge_lock);
@@ -657,6 +809,7 @@ static void purge_vmap_area_lazy(void)
 static void free_vmap_area_noflush(struct vmap_area *va)
 {
 	va->flags |= VM_LAZY_FREE;
+	llist_add(&va->purge_list, &vmap_purge_list);
 	atomic_add((va->va_end - va->va_start) >> PAGE_SHIFT, &vmap_lazy_nr);
 	if (unlikely(atomic_read(&vmap_lazy_nr) > lazy_max_pages()))
 		try_purge_vmap_area_lazy();
@@ -1182,6 +1335,16 @@ void __init vmalloc_init(void)
 		INIT_LIST_HEAD(&vbq->free);
 	}
 
+	for_each_possible_cpu(i) {
+		struct vmap_area_cache *vc;
+		int j;
+
+		vc = &per_cpu(vmap_area_cache, i);
+		spin_lock_init(&vc->lock);
+		for (j = 0; j < VMAP_CACHE_CLASSES; j++)
+			INIT_LIST_HEAD(&vc->free[j]);
+	}
+
 	/* Import existing vmlist entries. */
 	for (tmp = vmlist; tmp; tmp = tmp->next) {
 		va = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
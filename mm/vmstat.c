@@ -757,6 +757,11 @@ const char * const vmstat_text[] = {
 
 	"pgrotated",
 
+	"readahead_miss",
+	"readahead_hit",
+	"readahead_stream",
+	"readahead_stride",
+
 #ifdef CONFIG_COMPACTION
 	"compact_blocks_moved",
 	"compact_pages_moved",
@@ -764,6 +769,8 @@ const char * const vmstat_text[] = {
 	"compact_stall",
 	"compact_fail",
 	"compact_success",
+	"compact_daemon_wake",
+	"compact_daemon_proactive",
 #endif
 
 #ifdef CONFIG_HUGETLB_PAGE
@@ -787,6 +794,10 @@ const char * const vmstat_text[] = {
 	"thp_split",
 #endif
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	"speculative_pgfault",
+#endif
+
 #endif /* CONFIG_VM_EVENTS_COUNTERS */
 };
 #endif /* CONFIG_PROC_FS || CONFIG_SYSFS || CONFIG_NUMA */
@@ -135,10 +135,11 @@
 #include <linux/net_tstamp.h>
 #include <linux/static_key.h>
 #include <net/flow_keys.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
-/* Instead of increasing this, you should create a hash table. */
+/* Maximum number of skbs held in one GRO hash bucket */
 #define MAX_GRO_SKBS 8
 
 /* This should be increased if a protocol with a bigger head is added. */
@@ -2672,6 +2673,109 @@ set_rps_cpu(struct net_device *dev, struct sk_buff *skb,
 	return rflow;
 }
 
+#ifdef CONFIG_RFS_ACCEL
+/*
+ * Software RFS acceleration, for multiqueue devices that cannot steer
+ * single flows to a queue (no ntuple filters).  Every packet of a flow
+ * with a known consumer votes for that CPU on its receive queue; once
+ * one CPU holds a clear majority, the queue interrupt is moved there.
+ * Packets then arrive on the consuming CPU and RFS no longer needs an
+ * IPI to get them to it.  As the consuming threads migrate, the
+ * votes follow them via rps_sock_flow_table.
+ */
+#define RPS_IRQ_STEER_VOTES	256
+#define RPS_IRQ_STEER_INTERVAL	HZ
+
+static void rps_steer_rx_irq(struct net_device *dev,
+			     struct netdev_rx_queue *rxqueue, u16 next_cpu)
+{
+	unsigned long flags;
+
+	if (!rxqueue->irq || next_cpu == RPS_NO_CPU ||
+	    (dev->features & NETIF_F_NTUPLE))
+		return;
+
+	/*
+	 * We may be in hardirq context (netif_rx), so only count the vote
+	 * when nobody else is: losing a few does not change the majority.
+	 */
+	if (!spin_trylock_irqsave(&rxqueue->steer_lock, flags))
+		return;
+	if (!rxqueue->irq)
+		goto out;
+
+	/* Boyer-Moore majority vote over the packets of this queue */
+	if (!rxqueue->steer_votes) {
+		rxqueue->steer_cpu = next_cpu;
+		rxqueue->steer_votes = 1;
+		goto out;
+	}
+	if (rxqueue->steer_cpu != next_cpu) {
+		rxqueue->steer_votes--;
+		goto out;
+	}
+	if (++rxqueue->steer_votes < RPS_IRQ_STEER_VOTES)
+		goto out;
+
+	rxqueue->steer_votes = 0;
+	if (next_cpu != smp_processor_id() && cpu_online(next_cpu) &&
+	    time_after(jiffies, rxqueue->steer_stamp +
+				RPS_IRQ_STEER_INTERVAL)) {
+		rxqueue->steer_stamp = jiffies;
+		rxqueue->steer_target = next_cpu;
+		/* irq_set_affinity() may not be called from here */
+		schedule_work(&rxqueue->steer_work);
+	}
+out:
+	spin_unlock_irqrestore(&rxqueue->steer_lock, flags);
+}
+
+static void rps_steer_rx_irq_work(struct work_struct *work)
+{
+	struct netdev_rx_queue *rxqueue =
+		container_of(work, struct netdev_rx_queue, steer_work);
+	unsigned int irq;
+	u16 cpu;
+
+	spin_lock_irq(&rxqueue->steer_lock);
+	irq = rxqueue->irq;
+	cpu = rxqueue->steer_target;
+	spin_unlock_irq(&rxqueue->steer_lock);
+
+	if (irq && cpu_online(cpu))
+		irq_set_affinity(irq, cpumask_of(cpu));
+}
+
+/**
+ * netif_set_rx_queue_irq - set the interrupt of an RX queue
+ * @dev: Network device
+ * @rxq_index: RX queue index
+ * @irq: Interrupt raised by the queue, or 0 to stop steering it
+ *
+ * Drivers of multiqueue devices without ntuple filtering may call this
+ * so that RFS moves the affinity of @irq to the CPU consuming most of
+ * the flows received on the queue.  Steering must be stopped before
+ * the interrupt is freed.  Must be called from process context.
+ */
+void netif_set_rx_queue_irq(struct net_device *dev, u16 rxq_index,
+			    unsigned int irq)
+{
+	struct netdev_rx_queue *rxqueue = dev->_rx + rxq_index;
+
+	BUG_ON(rxq_index >= dev->num_rx_queues);
+	spin_lock_irq(&rxqueue->steer_lock);
+	rxqueue->steer_votes = 0;
+	rxqueue->steer_stamp = jiffies;
+	rxqueue->irq = irq;
+	spin_unlock_irq(&rxqueue->steer_lock);
+
+	/* A pending move of the old interrupt must not outlive it */
+	if (!irq)
+		cancel_work_sync(&rxqueue->steer_work);
+}
+EXPORT_SYMBOL(netif_set_rx_queue_irq);
+#endif /* CONFIG_RFS_ACCEL */
+
 /*
  * get_rps_cpu is called from netif_receive_skb and returns the target
  * CPU from the RPS map of the receiving queue for a given skb.
@@ -2729,6 +2833,10 @@ static int get_rps_cpu(struct net_device *dev, struct sk_buff *skb,
 		next_cpu = sock_flow_table->ents[skb->rxhash &
 		    sock_flow_table->mask];
 
+#ifdef CONFIG_RFS_ACCEL
+		rps_steer_rx_irq(dev, rxqueue, next_cpu);
+#endif
+
 		/*
 		 * If the desired CPU (where last recvmsg was done) is
 		 * different from current CPU (one in the rx-queue flow
@@ -3329,6 +3437,8 @@ static int napi_gro_complete(struct sk_buff *skb)
 	struct list_head *head = &ptype_base[ntohs(type) & PTYPE_HASH_MASK];
 	int err = -ENOENT;
 
+	__get_cpu_var(softnet_data).gro_flushed++;
+
 	if (NAPI_GRO_CB(skb)->count == 1) {
 		skb_shinfo(skb)->gso_size = 0;
 		goto out;
@@ -3354,23 +3464,72 @@ out:
 	return netif_receive_skb(skb);
 }
 
-inline void napi_gro_flush(struct napi_struct *napi)
+/*
+ * Pass up the skbs of a bucket that were held at or before 'before'.
+ * Buckets are ordered newest first, so those are at the tail.
+ */
+static void napi_gro_flush_chain(struct napi_struct *napi, unsigned int index,
+				 u64 before)
 {
+	struct gro_list *gro = &napi->gro_hash[index];
+	struct sk_buff **pp = &gro->list;
 	struct sk_buff *skb, *next;
 
-	for (skb = napi->gro_list; skb; skb = next) {
+	while ((skb = *pp) != NULL && NAPI_GRO_CB(skb)->age > before)
+		pp = &skb->next;
+	*pp = NULL;
+
+	for (; skb; skb = next) {
 		next = skb->next;
 		skb->next = NULL;
 		napi_gro_complete(skb);
+		gro->count--;
 	}
 
-	napi->gro_count = 0;
-	napi->gro_list = NULL;
+	if (!gro->count)
+		__clear_bit(index, &napi->gro_bitmask);
+}
+
+/* Pass up the skbs held for more than timeout ns, or all if timeout is 0 */
+static void __napi_gro_flush(struct napi_struct *napi, u64 timeout)
+{
+	unsigned long bitmask = napi->gro_bitmask;
+	u64 before = ~0ULL;
+	unsigned int i;
+
+	if (timeout) {
+		u64 now = local_clock();
+
+		before = now > timeout ? now - timeout : 0;
+	}
+
+	for_each_set_bit(i, &bitmask, GRO_HASH_BUCKETS)
+		napi_gro_flush_chain(napi, i, before);
+}
+
+void napi_gro_flush(struct napi_struct *napi)
+{
+	__napi_gro_flush(napi, 0);
 }
 EXPORT_SYMBOL(napi_gro_flush);
 
+/* Make room in a full bucket by passing up its oldest skb. */
+static void napi_gro_evict_oldest(struct gro_list *gro)
+{
+	struct sk_buff **pp = &gro->list;
+
+	while ((*pp)->next)
+		pp = &(*pp)->next;
+
+	napi_gro_complete(*pp);
+	*pp = NULL;
+	__get_cpu_var(softnet_data).gro_evicted++;
+}
+
 enum gro_result dev_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
+	u32 hash = skb->rxhash & (GRO_HASH_BUCKETS - 1);
+	struct gro_list *gro = &napi->gro_hash[hash];
 	struct sk_buff **pp = NULL;
 	struct packet_type *ptype;
 	__be16 type = skb->protocol;
@@ -3397,7 +3556,7 @@ enum gro_result dev_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 		NAPI_GRO_CB(skb)->flush = 0;
 		NAPI_GRO_CB(skb)->free = 0;
 
-		pp = ptype->gro_receive(&napi->gro_list, skb);
+		pp = ptype->gro_receive(&gro->list, skb);
 		break;
 	}
 	rcu_read_unlock();
@@ -3414,20 +3573,29 @@ enum gro_result dev_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 		*pp = nskb->next;
 		nskb->next = NULL;
 		napi_gro_complete(nskb);
-		napi->gro_count--;
+		if (!--gro->count)
+			__clear_bit(hash, &napi->gro_bitmask);
 	}
 
-	if (same_flow)
+	if (same_flow) {
+		__get_cpu_var(softnet_data).gro_merged++;
 		goto ok;
+	}
 
-	if (NAPI_GRO_CB(skb)->flush || napi->gro_count >= MAX_GRO_SKBS)
+	if (NAPI_GRO_CB(skb)->flush)
 		goto normal;
 
-	napi->gro_count++;
+	if (unlikely(gro->count >= MAX_GRO_SKBS))
+		napi_gro_evict_oldest(gro);
+	else
+		gro->count++;
+
 	NAPI_GRO_CB(skb)->count = 1;
+	NAPI_GRO_CB(skb)->age = local_clock();
 	skb_shinfo(skb)->gso_size = skb_gro_len(skb);
-	skb->next = napi->gro_list;
-	napi->gro_list = skb;
+	skb->next = gro->list;
+	gro->list = skb;
+	__set_bit(hash, &napi->gro_bitmask);
 	ret = GRO_HELD;
 
 pull:
@@ -3464,13 +3632,15 @@ EXPORT_SYMBOL(dev_gro_receive);
 static inline gro_result_t
 __napi_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
+	u32 hash = skb->rxhash & (GRO_HASH_BUCKETS - 1);
 	struct sk_buff *p;
 	unsigned int maclen = skb->dev->hard_header_len;
 
-	for (p = napi->gro_list; p; p = p->next) {
+	for (p = napi->gro_hash[hash].list; p; p = p->next) {
 		unsigned long diffs;
 
 		diffs = (unsigned long)p->dev ^ (unsigned long)skb->dev;
+		diffs |= p->rxhash ^ skb->rxhash;
 		diffs |= p->vlan_tci ^ skb->vlan_tci;
 		if (maclen == ETH_HLEN)
 			diffs |= compare_ether_header(skb_mac_header(p),
@@ -3525,6 +3695,7 @@ EXPORT_SYMBOL(skb_gro_reset_offset);
 
 gro_result_t napi_gro_receive(struct napi_struct *napi, struct sk_buff *skb)
 {
+	skb_mark_napi_id(skb, napi);
 	skb_gro_reset_offset(skb);
 
 	return napi_skb_finish(__napi_gro_receive(napi, skb), skb);
@@ -3627,6 +3798,7 @@ gro_result_t napi_gro_frags(struct napi_struct *napi)
 	if (!skb)
 		return GRO_DROP;
 
+	skb_mark_napi_id(skb, napi);
 	return napi_frags_finish(napi, skb, __napi_gro_receive(napi, skb));
 }
 EXPORT_SYMBOL(napi_gro_frags);
@@ -3735,9 +3907,11 @@ EXPORT_SYMBOL(__napi_schedule);
 void __napi_complete(struct napi_struct *n)
 {
 	BUG_ON(!test_bit(NAPI_STATE_SCHED, &n->state));
-	BUG_ON(n->gro_list);
 
-	list_del(&n->poll_list);
+	/* A busy polling socket may have run this napi without it ever
+	 * being queued on a poll_list, keep the entry self-linked.
+	 */
+	list_del_init(&n->poll_list);
 	smp_mb__before_clear_bit();
 	clear_bit(NAPI_STATE_SCHED, &n->state);
 }
@@ -3745,7 +3919,7 @@ EXPORT_SYMBOL(__napi_complete);
 
 void napi_complete(struct napi_struct *n)
 {
-	unsigned long flags;
+	unsigned long flags, timeout = 0;
 
 	/*
 	 * don't let napi dequeue from the cpu poll list
@@ -3754,19 +3928,194 @@ void napi_complete(struct napi_struct *n)
 	if (unlikely(test_bit(NAPI_STATE_NPSVC, &n->state)))
 		return;
 
-	napi_gro_flush(n);
+	if (n->gro_bitmask) {
+		timeout = n->dev->gro_flush_timeout;
+
+		/*
+		 * Keep recent flows around for the next poll rather than
+		 * flushing them at the end of every one; the timer makes
+		 * sure they are flushed if no more packets come in.
+		 */
+		__napi_gro_flush(n, timeout);
+		if (!n->gro_bitmask)
+			timeout = 0;
+	}
 	local_irq_save(flags);
 	__napi_complete(n);
 	local_irq_restore(flags);
+
+	/*
+	 * Only arm the timer once NAPI_STATE_SCHED is clear: napi_watchdog()
+	 * firing earlier would find the napi still scheduled and do
+	 * nothing, stranding the held skbs.
+	 */
+	if (timeout)
+		hrtimer_start(&n->timer, ns_to_ktime(timeout),
+			      HRTIMER_MODE_REL_PINNED);
 }
 EXPORT_SYMBOL(napi_complete);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+#define NAPI_HASH_BITS	8
+
+/* napi_hash_lock protects napi_hash and napi_gen_id, lookups are RCU */
+static DEFINE_SPINLOCK(napi_hash_lock);
+static struct hlist_head napi_hash[1 << NAPI_HASH_BITS];
+static unsigned int napi_gen_id;
+
+/* must be called under rcu_read_lock(), as we dont take a reference */
+static struct napi_struct *napi_by_id(unsigned int napi_id)
+{
+	unsigned int hash = napi_id & ((1 << NAPI_HASH_BITS) - 1);
+	struct napi_struct *napi;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu(napi, pos, &napi_hash[hash], napi_hash_node)
+		if (napi->napi_id == napi_id)
+			return napi;
+
+	return NULL;
+}
+
+static void napi_hash_add(struct napi_struct *napi)
+{
+	if (test_and_set_bit(NAPI_STATE_HASHED, &napi->state))
+		return;
+
+	spin_lock(&napi_hash_lock);
+
+	/* 0 is not a valid id, and we must not reuse one still in use */
+	do {
+		if (unlikely(++napi_gen_id == 0))
+			napi_gen_id = 1;
+	} while (napi_by_id(napi_gen_id));
+	napi->napi_id = napi_gen_id;
+
+	hlist_add_head_rcu(&napi->napi_hash_node,
+			   &napi_hash[napi->napi_id & ((1 << NAPI_HASH_BITS) - 1)]);
+
+	spin_unlock(&napi_hash_lock);
+}
+
+/* Warning : caller is responsible to make sure rcu grace period
+ * is respected before freeing memory containing @napi
+ */
+static bool napi_hash_del(struct napi_struct *napi)
+{
+	bool rcu_sync_needed = false;
+
+	spin_lock(&napi_hash_lock);
+
+	if (test_and_clear_bit(NAPI_STATE_HASHED, &napi->state)) {
+		rcu_sync_needed = true;
+		hlist_del_rcu(&napi->napi_hash_node);
+	}
+	spin_unlock(&napi_hash_lock);
+	return rcu_sync_needed;
+}
+
+/**
+ *	sk_busy_loop - poll the device the socket last received from
+ *	@sk: socket with an empty receive queue
+ *	@nonblock: do a single poll round instead of spinning
+ *
+ *	Run the NAPI poll routine the socket's last packet came through
+ *	until something shows up in the receive queue, sk->sk_ll_usec
+ *	microseconds have elapsed or the task has to reschedule.  The
+ *	poll is only run when the NAPI context is not already scheduled,
+ *	so it never races with net_rx_action() or the device interrupt.
+ *
+ *	Returns true if the receive queue is no longer empty.
+ */
+bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	unsigned long end_time = !nonblock ? sk_busy_loop_end_time(sk) : 0;
+	struct napi_struct *napi;
+	bool rc = false;
+
+	rcu_read_lock();
+
+	napi = napi_by_id(sk->sk_napi_id);
+	if (!napi)
+		goto out;
+
+	do {
+		int work = 0;
+
+		local_bh_disable();
+		if (napi_schedule_prep(napi)) {
+			void *have = netpoll_poll_lock(napi);
+
+			work = napi->poll(napi, BUSY_POLL_BUDGET);
+			trace_napi_poll(napi);
+			if (work == BUSY_POLL_BUDGET) {
+				/* More to do: hand the napi back to
+				 * net_rx_action(), the device interrupt
+				 * is still masked.
+				 */
+				napi_complete(napi);
+				napi_schedule(napi);
+			}
+			netpoll_poll_unlock(have);
+		}
+		if (work > 0)
+			NET_ADD_STATS_BH(sock_net(sk),
+					 LINUX_MIB_BUSYPOLLRXPACKETS, work);
+		local_bh_enable();
+
+		cpu_relax();
+	} while (!nonblock && skb_queue_empty(&sk->sk_receive_queue) &&
+		 !need_resched() && !busy_loop_timeout(end_time));
+
+	rc = !skb_queue_empty(&sk->sk_receive_queue);
+out:
+	rcu_read_unlock();
+	return rc;
+}
+EXPORT_SYMBOL(sk_busy_loop);
+#else
+static inline void napi_hash_add(struct napi_struct *napi)
+{
+}
+
+static inline bool napi_hash_del(struct napi_struct *napi)
+{
+	return false;
+}
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
+static enum hrtimer_restart napi_watchdog(struct hrtimer *timer)
+{
+	struct napi_struct *napi;
+
+	napi = container_of(timer, struct napi_struct, timer);
+
+	/* The next poll finds the held skbs expired and flushes them */
+	if (napi->gro_bitmask && !napi_disable_pending(napi) &&
+	    !test_and_set_bit(NAPI_STATE_SCHED, &napi->state))
+		__napi_schedule(napi);
+
+	return HRTIMER_NORESTART;
+}
+
+static void napi_gro_init(struct napi_struct *napi)
+{
+	int i;
+
+	napi->gro_bitmask = 0;
+	for (i = 0; i < GRO_HASH_BUCKETS; i++) {
+		napi->gro_hash[i].list = NULL;
+		napi->gro_hash[i].count = 0;
+	}
+	hrtimer_init(&napi->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+	napi->timer.function = napi_watchdog;
+}
+
 void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 		    int (*poll)(struct napi_struct *, int), int weight)
 {
 	INIT_LIST_HEAD(&napi->poll_list);
-	napi->gro_count = 0;
-	napi->gro_list = NULL;
+	napi_gro_init(napi);
 	napi->skb = NULL;
 	napi->poll = poll;
 	napi->weight = weight;
@@ -3777,24 +4126,33 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 	napi->poll_owner = -1;
 #endif
 	set_bit(NAPI_STATE_SCHED, &napi->state);
+	napi_hash_add(napi);
 }
 EXPORT_SYMBOL(netif_napi_add);
 
 void netif_napi_del(struct napi_struct *napi)
 {
 	struct sk_buff *skb, *next;
+	int i;
+
+	/* busy pollers may still be looking at it */
+	if (napi_hash_del(napi))
+		synchronize_net();
 
 	list_del_init(&napi->dev_list);
 	napi_free_frags(napi);
+	hrtimer_cancel(&napi->timer);
 
-	for (skb = napi->gro_list; skb; skb = next) {
-		next = skb->next;
-		skb->next = NULL;
-		kfree_skb(skb);
+	for (i = 0; i < GRO_HASH_BUCKETS; i++) {
+		for (skb = napi->gro_hash[i].list; skb; skb = next) {
+			next = skb->next;
+			skb->next = NULL;
+			kfree_skb(skb);
+		}
+		napi->gro_hash[i].list = NULL;
+		napi->gro_hash[i].count = 0;
 	}
-
-	napi->gro_list = NULL;
-	napi->gro_count = 0;
+	napi->gro_bitmask = 0;
 }
 EXPORT_SYMBOL(netif_napi_del);
 
@@ -3859,8 +4217,19 @@ static void net_rx_action(struct softirq_action *h)
 				local_irq_enable();
 				napi_complete(n);
 				local_irq_disable();
-			} else
+			} else {
+				if (n->gro_bitmask) {
+					/* Do not hold flows for too long
+					 * while the device stays busy.
+					 */
+					local_irq_enable();
+					__napi_gro_flush(n,
+						n->dev->gro_flush_timeout ?:
+						TICK_NSEC);
+					local_irq_disable();
+				}
 				list_move_tail(&n->poll_list, &sd->poll_list);
+			}
 		}
 
 		netpoll_poll_unlock(have);
@@ -4144,10 +4513,12 @@ static int softnet_seq_show(struct seq_file *seq, void *v)
 {
 	struct softnet_data *sd = v;
 
-	seq_printf(seq, "%08x %08x %08x %08x %08x %08x %08x %08x %08x %08x\n",
+	seq_printf(seq, "%08x %08x %08x %08x %08x %08x %08x %08x %08x %08x"
+		   " %08x %08x %08x\n",
 		   sd->processed, sd->dropped, sd->time_squeeze, 0,
 		   0, 0, 0, 0, /* was fastroute */
-		   sd->cpu_collision, sd->received_rps);
+		   sd->cpu_collision, sd->received_rps,
+		   sd->gro_merged, sd->gro_flushed, sd->gro_evicted);
 	return 0;
 }
 
@@ -5409,8 +5780,13 @@ static int netif_alloc_rx_queues(struct net_device *dev)
 	}
 	dev->_rx = rx;
 
-	for (i = 0; i < count; i++)
+	for (i = 0; i < count; i++) {
 		rx[i].dev = dev;
+#ifdef CONFIG_RFS_ACCEL
+		spin_lock_init(&rx[i].steer_lock);
+		INIT_WORK(&rx[i].steer_work, rps_steer_rx_irq_work);
+#endif
+	}
 	return 0;
 }
 #endif
@@ -6513,8 +6889,7 @@ static int __init net_dev_init(void)
 
 		sd->backlog.poll = process_backlog;
 		sd->backlog.weight = weight_p;
-		sd->backlog.gro_list = NULL;
-		sd->backlog.gro_count = 0;
+		napi_gro_init(&sd->backlog);
 	}
 
 	dev_boot_phase = 0;
@@ -25,6 +25,10 @@ struct esp_skb_cb {
 
 #define ESP_SKB_CB(__skb) ((struct esp_skb_cb *)&((__skb)->cb[0]))
 
+static bool esp_parallel = IS_ENABLED(CONFIG_CRYPTO_PCRYPT);
+module_param_named(parallel, esp_parallel, bool, 0644);
+MODULE_PARM_DESC(parallel, "Spread the crypto of each SA over all CPUs using pcrypt");
+
 static u32 esp4_get_mtu(struct xfrm_state *x, int mtu);
 
 /*
@@ -508,13 +512,33 @@ static void esp_destroy(struct xfrm_state *x)
 	kfree(esp);
 }
 
+/*
+ * With pcrypt, the requests of one SA are processed on all CPUs, and
+ * completed in the order they were submitted, so packets are not
+ * reordered.  Fall back to the plain algorithm if it is not available.
+ */
+static struct crypto_aead *esp_alloc_aead(const char *name)
+{
+	char pname[CRYPTO_MAX_ALG_NAME];
+	struct crypto_aead *aead;
+
+	if (esp_parallel &&
+	    snprintf(pname, sizeof(pname), "pcrypt(%s)", name) < sizeof(pname)) {
+		aead = crypto_alloc_aead(pname, 0, 0);
+		if (!IS_ERR(aead))
+			return aead;
+	}
+
+	return crypto_alloc_aead(name, 0, 0);
+}
+
 static int esp_init_aead(struct xfrm_state *x)
 {
 	struct esp_data *esp = x->data;
 	struct crypto_aead *aead;
 	int err;
 
-	aead = crypto_alloc_aead(x->aead->alg_name, 0, 0);
+	aead = esp_alloc_aead(x->aead->alg_name);
 	err = PTR_ERR(aead);
 	if (IS_ERR(aead))
 		goto error;
@@ -566,7 +590,7 @@ static int esp_init_authenc(struct xfrm_state *x)
 			goto error;
 	}
 
-	aead = crypto_alloc_aead(authenc_name, 0, 0);
+	aead = esp_alloc_aead(authenc_name);
 	err = PTR_ERR(aead);
 	if (IS_ERR(aead))
 		goto error;
@@ -173,12 +173,13 @@ void fib_release_info(struct fib_info *fi)
 		hlist_del(&fi->fib_hash);
 		if (fi->fib_prefsrc)
 			hlist_del(&fi->fib_lhash);
+		fi->fib_dead = 1;
 		change_nexthops(fi) {
 			if (!nexthop_nh->nh_dev)
 				continue;
 			hlist_del(&nexthop_nh->nh_hash);
+			rt_flush_nh(nexthop_nh);
 		} endfor_nexthops(fi)
-		fi->fib_dead = 1;
 		fib_info_put(fi);
 	}
 	spin_unlock_bh(&fib_info_lock);
@@ -1060,6 +1061,7 @@ int fib_sync_down_dev(struct net_device *dev, int force)
 				nexthop_nh->nh_power = 0;
 				spin_unlock_bh(&fib_multipath_lock);
 #endif
+				rt_flush_nh(nexthop_nh);
 				dead++;
 			}
 #ifdef CONFIG_IP_ROUTE_MULTIPATH
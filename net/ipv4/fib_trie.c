@@ -123,9 +123,11 @@ struct tnode {
 	unsigned char bits;		/* 2log(KEYLENGTH) bits needed */
 	unsigned int full_children;	/* KEYLENGTH bits needed */
 	unsigned int empty_children;	/* KEYLENGTH bits needed */
+	/* Kept small so that the first child pointers share a cache
+	 * line with the node header.
+	 */
 	union {
 		struct rcu_head rcu;
-		struct work_struct work;
 		struct tnode *tnode_free;
 	};
 	struct rt_trie_node __rcu *child[0];
@@ -155,7 +157,7 @@ struct trie_stat {
 struct trie {
 	struct rt_trie_node __rcu *trie;
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-	struct trie_use_stats stats;
+	struct trie_use_stats __percpu *stats;
 #endif
 };
 
@@ -384,12 +386,27 @@ static struct tnode *tnode_alloc(size_t size)
 		return vzalloc(size);
 }
 
+/* vmalloc()ed tnodes waiting for process context, chained by tnode_free */
+static struct tnode *tnode_vfree_head;
+static DEFINE_SPINLOCK(tnode_vfree_lock);
+
 static void __tnode_vfree(struct work_struct *arg)
 {
-	struct tnode *tn = container_of(arg, struct tnode, work);
-	vfree(tn);
+	struct tnode *tn, *next;
+
+	spin_lock_bh(&tnode_vfree_lock);
+	tn = tnode_vfree_head;
+	tnode_vfree_head = NULL;
+	spin_unlock_bh(&tnode_vfree_lock);
+
+	for (; tn; tn = next) {
+		next = tn->tnode_free;
+		vfree(tn);
+	}
 }
 
+static DECLARE_WORK(tnode_vfree_work, __tnode_vfree);
+
 static void __tnode_free_rcu(struct rcu_head *head)
 {
 	struct tnode *tn = container_of(head, struct tnode, rcu);
@@ -399,8 +416,11 @@ static void __tnode_free_rcu(struct rcu_head *head)
 	if (size <= PAGE_SIZE)
 		kfree(tn);
 	else {
-		INIT_WORK(&tn->work, __tnode_vfree);
-		schedule_work(&tn->work);
+		spin_lock(&tnode_vfree_lock);
+		tn->tnode_free = tnode_vfree_head;
+		tnode_vfree_head = tn;
+		spin_unlock(&tnode_vfree_lock);
+		schedule_work(&tnode_vfree_work);
 	}
 }
 
@@ -642,7 +662,7 @@ static struct rt_trie_node *resize(struct trie *t, struct tnode *tn)
 		if (IS_ERR(tn)) {
 			tn = old_tn;
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-			t->stats.resize_node_skipped++;
+			this_cpu_inc(t->stats->resize_node_skipped);
 #endif
 			break;
 		}
@@ -669,7 +689,7 @@ static struct rt_trie_node *resize(struct trie *t, struct tnode *tn)
 		if (IS_ERR(tn)) {
 			tn = old_tn;
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-			t->stats.resize_node_skipped++;
+			this_cpu_inc(t->stats->resize_node_skipped);
 #endif
 			break;
 		}
@@ -1378,7 +1398,7 @@ static int check_leaf(struct fib_table *tb, struct trie *t, struct leaf *l,
 			err = fib_props[fa->fa_type].error;
 			if (err) {
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-				t->stats.semantic_match_passed++;
+				this_cpu_inc(t->stats->semantic_match_passed);
 #endif
 				return err;
 			}
@@ -1393,7 +1413,7 @@ static int check_leaf(struct fib_table *tb, struct trie *t, struct leaf *l,
 					continue;
 
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-				t->stats.semantic_match_passed++;
+				this_cpu_inc(t->stats->semantic_match_passed);
 #endif
 				res->prefixlen = li->plen;
 				res->nh_sel = nhsel;
@@ -1409,7 +1429,7 @@ static int check_leaf(struct fib_table *tb, struct trie *t, struct leaf *l,
 		}
 
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-		t->stats.semantic_match_miss++;
+		this_cpu_inc(t->stats->semantic_match_miss);
 #endif
 	}
 
@@ -1438,7 +1458,7 @@ int fib_table_lookup(struct fib_table *tb, const struct flowi4 *flp,
 		goto failed;
 
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-	t->stats.gets++;
+	this_cpu_inc(t->stats->gets);
 #endif
 
 	/* Just a leaf? */
@@ -1462,7 +1482,7 @@ int fib_table_lookup(struct fib_table *tb, const struct flowi4 *flp,
 
 		if (n == NULL) {
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-			t->stats.null_node_hit++;
+			this_cpu_inc(t->stats->null_node_hit);
 #endif
 			goto backtrace;
 		}
@@ -1476,6 +1496,12 @@ int fib_table_lookup(struct fib_table *tb, const struct flowi4 *flp,
 
 		cn = (struct tnode *)n;
 
+		/* Start pulling in the next level while the skipped bits
+		 * of this one are being checked.
+		 */
+		prefetch(tnode_get_child_rcu(cn, tkey_extract_bits(key, cn->pos,
+								   cn->bits)));
+
 		/*
 		 * It's a tnode, and we can do some extra checks here if we
 		 * like, to avoid descending into a dead-end branch.
@@ -1596,7 +1622,7 @@ backtrace:
 			chopped_off = 0;
 
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-			t->stats.backtrack++;
+			this_cpu_inc(t->stats->backtrack);
 #endif
 			goto backtrace;
 		}
@@ -1850,6 +1876,11 @@ int fib_table_flush(struct fib_table *tb)
 
 void fib_free_table(struct fib_table *tb)
 {
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+	struct trie *t = (struct trie *) tb->tb_data;
+
+	free_percpu(t->stats);
+#endif
 	kfree(tb);
 }
 
@@ -1996,6 +2027,14 @@ struct fib_table *fib_trie_table(u32 id)
 	t = (struct trie *) tb->tb_data;
 	memset(t, 0, sizeof(*t));
 
+#ifdef CONFIG_IP_FIB_TRIE_STATS
+	t->stats = alloc_percpu(struct trie_use_stats);
+	if (!t->stats) {
+		kfree(tb);
+		return NULL;
+	}
+#endif
+
 	return tb;
 }
 
@@ -2161,18 +2200,33 @@ static void trie_show_stats(struct seq_file *seq, struct trie_stat *stat)
 
 #ifdef CONFIG_IP_FIB_TRIE_STATS
 static void trie_show_usage(struct seq_file *seq,
-			    const struct trie_use_stats *stats)
+			    const struct trie_use_stats __percpu *stats)
 {
+	struct trie_use_stats s = { 0 };
+	int cpu;
+
+	/* loop through all of the CPUs and gather up the stats */
+	for_each_possible_cpu(cpu) {
+		const struct trie_use_stats *pcpu = per_cpu_ptr(stats, cpu);
+
+		s.gets += pcpu->gets;
+		s.backtrack += pcpu->backtrack;
+		s.semantic_match_passed += pcpu->semantic_match_passed;
+		s.semantic_match_miss += pcpu->semantic_match_miss;
+		s.null_node_hit += pcpu->null_node_hit;
+		s.resize_node_skipped += pcpu->resize_node_skipped;
+	}
+
 	seq_printf(seq, "\nCounters:\n---------\n");
-	seq_printf(seq, "gets = %u\n", stats->gets);
-	seq_printf(seq, "backtracks = %u\n", stats->backtrack);
+	seq_printf(seq, "gets = %u\n", s.gets);
+	seq_printf(seq, "backtracks = %u\n", s.backtrack);
 	seq_printf(seq, "semantic match passed = %u\n",
-		   stats->semantic_match_passed);
+		   s.semantic_match_passed);
 	seq_printf(seq, "semantic match miss = %u\n",
-		   stats->semantic_match_miss);
-	seq_printf(seq, "null node hit= %u\n", stats->null_node_hit);
+		   s.semantic_match_miss);
+	seq_printf(seq, "null node hit= %u\n", s.null_node_hit);
 	seq_printf(seq, "skipped node resize = %u\n\n",
-		   stats->resize_node_skipped);
+		   s.resize_node_skipped);
 }
 #endif /*  CONFIG_IP_FIB_TRIE_STATS */
 
@@ -2214,7 +2268,7 @@ static int fib_triestat_seq_show(struct seq_file *seq, void *v)
 			trie_collect_stats(t, &stat);
 			trie_show_stats(seq, &stat);
 #ifdef CONFIG_IP_FIB_TRIE_STATS
-			trie_show_usage(seq, &t->stats);
+			trie_show_usage(seq, t->stats);
 #endif
 		}
 	}
@@ -24,6 +24,8 @@
 #include <linux/proc_fs.h>
 #include <linux/err.h>
 #include <linux/cpumask.h>
+#include <linux/jhash.h>
+#include <linux/sort.h>
 
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
@@ -284,6 +286,277 @@ struct ipt_entry *ipt_next_entry(const struct ipt_entry *entry)
 	return (void *)entry + entry->next_offset;
 }
 
+#ifdef CONFIG_IP_NF_IPTABLES_INDEX
+/*
+ * Rule index.
+ *
+ * Big rulesets are mostly long runs of rules which only differ in the
+ * source or destination prefix they test.  When a table is loaded, each
+ * run of at least IPT_INDEX_MIN_RUN consecutive rules testing the same
+ * address field with the same, non inverted, mask gets a hash of the
+ * masked addresses.  A rule of the run can only match a packet if the
+ * packet address equals the rule address under that mask, so when a
+ * rule of a run does not match, ipt_do_table() resumes at the next rule
+ * of the run having the packet's address instead of trying every rule
+ * in between.  Rules are still evaluated in order: verdicts and
+ * counters are the same as with a linear walk.
+ */
+#define IPT_INDEX_MIN_RUN	16
+#define IPT_INDEX_BIT(off)	((off) / __alignof__(struct ipt_entry))
+
+enum {
+	IPT_INDEX_SRC,
+	IPT_INDEX_DST,
+};
+
+struct ipt_index_slot {
+	__be32			addr;
+	unsigned int		offset;
+};
+
+struct ipt_index_run {
+	unsigned int		start;	/* offset of the first rule */
+	unsigned int		end;	/* offset of the rule after the run */
+	__be32			mask;
+	u8			field;
+	unsigned int		hmask;
+	unsigned int		*hash;	/* 1 + first slot of an address */
+	struct ipt_index_slot	*slot;	/* sorted by address, then offset */
+	unsigned int		nslots;
+};
+
+struct ipt_index {
+	unsigned int		nruns;
+	unsigned long		*inrun;	/* offsets of rules belonging to a run */
+	struct ipt_index_run	run[0];
+};
+
+static inline u32 ipt_index_hash(__be32 addr)
+{
+	return jhash_1word((__force u32)addr, 0);
+}
+
+/* Performance critical: called when a rule of a run did not match. */
+static unsigned int
+ipt_index_next(const struct ipt_index *idx, const struct iphdr *ip,
+	       unsigned int off)
+{
+	const struct ipt_index_run *run;
+	const struct ipt_index_slot *s, *last;
+	unsigned int lo = 0, hi = idx->nruns, h, i;
+	__be32 addr;
+
+	while (hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (idx->run[mid].start <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	run = &idx->run[lo];
+
+	addr = run->field == IPT_INDEX_SRC ? ip->saddr : ip->daddr;
+	addr &= run->mask;
+
+	h = ipt_index_hash(addr) & run->hmask;
+	while ((i = run->hash[h]) != 0) {
+		s = &run->slot[i - 1];
+		if (s->addr == addr) {
+			last = run->slot + run->nslots;
+			for (; s < last && s->addr == addr; s++)
+				if (s->offset > off)
+					return s->offset;
+			break;
+		}
+		h = (h + 1) & run->hmask;
+	}
+	return run->end;
+}
+
+static bool
+ipt_index_mask(const struct ipt_entry *e, u8 field, __be32 *mask)
+{
+	if (field == IPT_INDEX_SRC) {
+		if (e->ip.invflags & IPT_INV_SRCIP)
+			return false;
+		*mask = e->ip.smsk.s_addr;
+	} else {
+		if (e->ip.invflags & IPT_INV_DSTIP)
+			return false;
+		*mask = e->ip.dmsk.s_addr;
+	}
+	return *mask != 0;
+}
+
+/* Number of rules from @off on that test @field under the same mask. */
+static unsigned int
+ipt_index_run_len(const void *base, unsigned int size, unsigned int off,
+		  u8 field, __be32 *mask, unsigned int *end)
+{
+	const struct ipt_entry *e;
+	unsigned int n = 0;
+	__be32 m;
+
+	while (off < size) {
+		e = get_entry(base, off);
+		if (!ipt_index_mask(e, field, &m) || (n && m != *mask))
+			break;
+		*mask = m;
+		off += e->next_offset;
+		n++;
+	}
+	*end = off;
+	return n;
+}
+
+/* Finds the runs worth indexing; fills @run when not NULL. */
+static unsigned int
+ipt_index_scan(const void *base, unsigned int size,
+	       struct ipt_index_run *run, unsigned int *nslots,
+	       unsigned int *nbuckets)
+{
+	unsigned int off = 0, nruns = 0;
+
+	*nslots = *nbuckets = 0;
+	while (off < size) {
+		unsigned int nsrc, ndst, send, dend, n;
+		__be32 smask = 0, dmask = 0;
+		u8 field;
+
+		nsrc = ipt_index_run_len(base, size, off, IPT_INDEX_SRC,
+					 &smask, &send);
+		ndst = ipt_index_run_len(base, size, off, IPT_INDEX_DST,
+					 &dmask, &dend);
+		field = nsrc >= ndst ? IPT_INDEX_SRC : IPT_INDEX_DST;
+		n = max(nsrc, ndst);
+		if (n < IPT_INDEX_MIN_RUN) {
+			off += get_entry(base, off)->next_offset;
+			continue;
+		}
+
+		if (run) {
+			run[nruns].start  = off;
+			run[nruns].end    = field == IPT_INDEX_SRC ? send : dend;
+			run[nruns].mask   = field == IPT_INDEX_SRC ? smask : dmask;
+			run[nruns].field  = field;
+			run[nruns].nslots = n;
+			run[nruns].hmask  = roundup_pow_of_two(2 * n) - 1;
+		}
+		*nslots += n;
+		*nbuckets += roundup_pow_of_two(2 * n);
+		nruns++;
+		off = field == IPT_INDEX_SRC ? send : dend;
+	}
+	return nruns;
+}
+
+static int ipt_index_slot_cmp(const void *a, const void *b)
+{
+	const struct ipt_index_slot *sa = a, *sb = b;
+	u32 x = ntohl(sa->addr), y = ntohl(sb->addr);
+
+	if (x != y)
+		return x < y ? -1 : 1;
+	if (sa->offset != sb->offset)
+		return sa->offset < sb->offset ? -1 : 1;
+	return 0;
+}
+
+static void
+ipt_index_fill(const void *base, struct ipt_index *idx,
+	       struct ipt_index_run *run)
+{
+	unsigned int off, i, h;
+	const struct ipt_entry *e;
+
+	for (off = run->start, i = 0; off < run->end; off += e->next_offset) {
+		e = get_entry(base, off);
+		run->slot[i].addr = run->field == IPT_INDEX_SRC ?
+				    e->ip.src.s_addr : e->ip.dst.s_addr;
+		run->slot[i].offset = off;
+		__set_bit(IPT_INDEX_BIT(off), idx->inrun);
+		i++;
+	}
+	sort(run->slot, run->nslots, sizeof(run->slot[0]),
+	     ipt_index_slot_cmp, NULL);
+
+	for (i = 0; i < run->nslots; i++) {
+		if (i && run->slot[i].addr == run->slot[i - 1].addr)
+			continue;
+		h = ipt_index_hash(run->slot[i].addr) & run->hmask;
+		while (run->hash[h] != 0)
+			h = (h + 1) & run->hmask;
+		run->hash[h] = i + 1;
+	}
+}
+
+/* Build the index of a new table.  Failing is not fatal: the table
+ * is then walked linearly.
+ */
+static void ipt_index_build(struct xt_table_info *newinfo, const void *entry0)
+{
+	struct ipt_index *idx;
+	unsigned int nruns, nslots, nbuckets, nlongs, i;
+	unsigned int *hash;
+	struct ipt_index_slot *slot;
+	size_t sz;
+
+	nruns = ipt_index_scan(entry0, newinfo->size, NULL,
+			       &nslots, &nbuckets);
+	if (nruns == 0)
+		return;
+
+	nlongs = BITS_TO_LONGS(IPT_INDEX_BIT(newinfo->size));
+	sz = sizeof(*idx) + nruns * sizeof(idx->run[0]) +
+	     nslots * sizeof(*slot) + nlongs * sizeof(long) +
+	     nbuckets * sizeof(*hash);
+	if (sz <= PAGE_SIZE)
+		idx = kzalloc(sz, GFP_KERNEL);
+	else
+		idx = vzalloc(sz);
+	if (idx == NULL)
+		return;
+
+	idx->nruns = nruns;
+	ipt_index_scan(entry0, newinfo->size, idx->run, &nslots, &nbuckets);
+
+	slot = (void *)&idx->run[nruns];
+	idx->inrun = (void *)&slot[nslots];
+	hash = (void *)&idx->inrun[nlongs];
+	for (i = 0; i < nruns; i++) {
+		idx->run[i].slot = slot;
+		idx->run[i].hash = hash;
+		slot += idx->run[i].nslots;
+		hash += idx->run[i].hmask + 1;
+		ipt_index_fill(entry0, idx, &idx->run[i]);
+	}
+
+	newinfo->index = idx;
+	newinfo->index_size = sz;
+}
+#else
+static inline void
+ipt_index_build(struct xt_table_info *newinfo, const void *entry0)
+{
+}
+#endif
+
+/* Performance critical */
+static inline struct ipt_entry *
+ipt_next_rule(const void *base, const struct xt_table_info *private,
+	      const struct iphdr *ip, const struct ipt_entry *e)
+{
+#ifdef CONFIG_IP_NF_IPTABLES_INDEX
+	const struct ipt_index *idx = private->index;
+	unsigned int off = (void *)e - base;
+
+	if (idx != NULL && test_bit(IPT_INDEX_BIT(off), idx->inrun))
+		return get_entry(base, ipt_index_next(idx, ip, off));
+#endif
+	return ipt_next_entry(e);
+}
+
 /* Returns one of the generic firewall policies, like NF_ACCEPT. */
 unsigned int
 ipt_do_table(struct sk_buff *skb,
@@ -346,7 +619,7 @@ ipt_do_table(struct sk_buff *skb,
 		if (!ip_packet_match(ip, indev, outdev,
 		    &e->ip, acpar.fragoff)) {
  no_match:
-			e = ipt_next_entry(e);
+			e = ipt_next_rule(table_base, private, ip, e);
 			continue;
 		}
 
@@ -869,6 +1142,7 @@ translate_table(struct net *net, struct xt_table_info *newinfo, void *entry0,
 			memcpy(newinfo->entries[i], entry0, newinfo->size);
 	}
 
+	ipt_index_build(newinfo, entry0);
 	return ret;
 }
 
@@ -1767,6 +2041,7 @@ translate_compat_table(struct net *net,
 		if (newinfo->entries[i] && newinfo->entries[i] != entry1)
 			memcpy(newinfo->entries[i], entry1, newinfo->size);
 
+	ipt_index_build(newinfo, entry1);
 	*pinfo = newinfo;
 	*pentry0 = entry1;
 	xt_free_table_info(info);
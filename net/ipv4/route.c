@@ -133,6 +133,7 @@ static int ip_rt_mtu_expires __read_mostly	= 10 * 60 * HZ;
 static int ip_rt_min_pmtu __read_mostly		= 512 + 20 + 20;
 static int ip_rt_min_advmss __read_mostly	= 256;
 static int rt_chain_length_max __read_mostly	= 20;
+static int ip_rt_nocache __read_mostly;
 
 static struct delayed_work expires_work;
 static unsigned long expires_ljiffies;
@@ -721,7 +722,8 @@ static inline u32 rt_score(struct rtable *rt)
 
 static inline bool rt_caching(const struct net *net)
 {
-	return net->ipv4.current_rt_cache_rebuild_count <=
+	return !ip_rt_nocache &&
+		net->ipv4.current_rt_cache_rebuild_count <=
 		net->ipv4.sysctl_rt_cache_rebuild_count;
 }
 
@@ -1333,6 +1335,10 @@ void rt_bind_peer(struct rtable *rt, __be32 daddr, int create)
 {
 	struct inet_peer *peer;
 
+	/* Routes shared by many destinations never carry a peer */
+	if (rt->dst.flags & DST_NOPEER)
+		return;
+
 	peer = inet_getpeer_v4(daddr, create);
 
 	if (peer && cmpxchg(&rt->peer, NULL, peer) != NULL)
@@ -1430,6 +1436,34 @@ static void check_peer_redir(struct dst_entry *dst, struct inet_peer *peer)
 	}
 }
 
+/*
+ * A PMTU or redirect has been learned for @daddr.  Mark the nexthops it
+ * is routed through, so that forwarded packets to it stop sharing their
+ * nexthop input routes and get private ones carrying the peer instead.
+ */
+static void rt_nh_note_exception(struct net *net, __be32 daddr)
+{
+	struct flowi4 fl4 = { .daddr = daddr };
+	struct fib_result res;
+	struct fib_info *fi;
+	int i;
+
+	rcu_read_lock();
+	if (fib_lookup(net, &fl4, &res) == 0 && res.fi) {
+		fi = res.fi;
+		for (i = 0; i < fi->fib_nhs; i++) {
+			struct fib_nh *nh = &fi->fib_nh[i];
+
+			/* Already shared routes must not outlive the mark */
+			if (!nh->nh_exceptions) {
+				nh->nh_exceptions = true;
+				rt_flush_nh(nh);
+			}
+		}
+	}
+	rcu_read_unlock();
+}
+
 /* called in rcu_read_lock() section */
 void ip_rt_redirect(__be32 old_gw, __be32 daddr, __be32 new_gw,
 		    __be32 saddr, struct net_device *dev)
@@ -1492,6 +1526,7 @@ void ip_rt_redirect(__be32 old_gw, __be32 daddr, __be32 new_gw,
 					if (peer->redirect_learned.a4 != new_gw) {
 						peer->redirect_learned.a4 = new_gw;
 						atomic_inc(&__rt_peer_genid);
+						rt_nh_note_exception(net, daddr);
 					}
 					check_peer_redir(&rt->dst, peer);
 				}
@@ -1727,6 +1762,7 @@ unsigned short ip_rt_frag_needed(struct net *net, const struct iphdr *iph,
 			peer->pmtu_learned = mtu;
 			peer->pmtu_expires = pmtu_expires;
 			atomic_inc(&__rt_peer_genid);
+			rt_nh_note_exception(net, iph->daddr);
 		}
 
 		inet_putpeer(peer);
@@ -1777,6 +1813,7 @@ static void ip_rt_update_pmtu(struct dst_entry *dst, u32 mtu)
 
 			atomic_inc(&__rt_peer_genid);
 			rt->rt_peer_genid = rt_peer_genid();
+			rt_nh_note_exception(dev_net(dst->dev), rt->rt_dst);
 		}
 		check_peer_pmtu(dst, peer);
 	}
@@ -1949,7 +1986,11 @@ static void rt_init_metrics(struct rtable *rt, const struct flowi4 *fl4,
 	if (fl4 && (fl4->flowi4_flags & FLOWI_FLAG_PRECOW_METRICS))
 		create = 1;
 
-	rt->peer = peer = inet_getpeer_v4(rt->rt_dst, create);
+	if (rt->dst.flags & DST_NOPEER)
+		peer = NULL;
+	else
+		peer = inet_getpeer_v4(rt->rt_dst, create);
+	rt->peer = peer;
 	if (peer) {
 		rt->rt_peer_genid = rt_peer_genid();
 		if (inet_metrics_new(peer))
@@ -2117,12 +2158,112 @@ static void ip_handle_martian_source(struct net_device *dev,
 #endif
 }
 
+/*
+ * Without the route cache every forwarded packet would allocate its own
+ * dst.  Instead, plain gatewayed forwarding routes are kept on the
+ * nexthop and shared by all destinations reached through it, one per
+ * input interface slot.  Anything that makes the route depend on the
+ * particular source or destination (redirects, IP options, realms,
+ * learned PMTU or redirects) keeps using a private route.  Learned state
+ * is only looked up behind nexthops that rt_nh_note_exception() marked,
+ * so the common case costs no inet_peer lookup per packet.
+ */
+static bool rt_nh_input_cacheable(struct net *net, const struct sk_buff *skb,
+				  const struct fib_result *res,
+				  unsigned int flags, u32 itag, __be32 daddr)
+{
+	struct inet_peer *peer;
+	bool ret = true;
+
+	/*
+	 * The dummy skb of inet_rtm_getroute() carries no IP header: give
+	 * it a private route, so that rt_fill_info() reports its own keys
+	 * rather than those of the shared one.
+	 */
+	if (rt_caching(net) ||
+	    skb->protocol != htons(ETH_P_IP) ||
+	    skb->len < sizeof(struct iphdr) ||
+	    ip_hdr(skb)->ihl != 5 ||
+	    (flags & RTCF_DOREDIRECT) || itag ||
+	    !FIB_RES_GW(*res) ||
+	    FIB_RES_NH(*res).nh_scope != RT_SCOPE_LINK)
+		return false;
+#if defined(CONFIG_IP_ROUTE_CLASSID) && defined(CONFIG_IP_MULTIPLE_TABLES)
+	if (fib_rules_tclass(res))
+		return false;
+#endif
+
+	if (!FIB_RES_NH(*res).nh_exceptions)
+		return true;
+	peer = inet_getpeer_v4(daddr, 0);
+	if (peer) {
+		ret = !peer->pmtu_expires && !peer->redirect_learned.a4;
+		inet_putpeer(peer);
+	}
+	return ret;
+}
+
+static inline struct rtable __rcu **rt_nh_input_slot(struct fib_nh *nh,
+						     int iif)
+{
+	return &nh->nh_rth_input[iif & (FIB_NH_INPUT_CACHE - 1)];
+}
+
+/* called in rcu_read_lock() section */
+static struct rtable *rt_nh_input_get(struct fib_nh *nh, int iif,
+				      unsigned int flags)
+{
+	struct rtable *rth = rcu_dereference(*rt_nh_input_slot(nh, iif));
+
+	if (rth && rth->rt_iif == iif && rth->rt_flags == flags &&
+	    !rt_is_expired(rth))
+		return rth;
+	return NULL;
+}
+
+static void rt_nh_input_set(struct fib_info *fi, struct fib_nh *nh,
+			    struct rtable *rt)
+{
+	struct rtable **p = (struct rtable **)rt_nh_input_slot(nh, rt->rt_iif);
+	struct rtable *orig = rcu_dereference(*p);
+
+	if (cmpxchg(p, orig, rt) != orig) {
+		/* Lost the race, use the route once */
+		rt->dst.flags |= DST_NOCACHE;
+		return;
+	}
+	if (orig)
+		rt_free(orig);
+
+	/* Pairs with the flush done once the nexthop or fib_info dies */
+	if (fi->fib_dead || (nh->nh_flags & RTNH_F_DEAD))
+		rt_flush_nh(nh);
+}
+
+/*
+ * Drop the routes cached on a nexthop.  Called when the nexthop goes
+ * down or its fib_info is released, so that they do not pin the
+ * device or the fib_info.
+ */
+void rt_flush_nh(struct fib_nh *nh)
+{
+	int i;
+
+	for (i = 0; i < FIB_NH_INPUT_CACHE; i++) {
+		struct rtable *rt;
+
+		rt = xchg((struct rtable **)&nh->nh_rth_input[i], NULL);
+		if (rt)
+			rt_free(rt);
+	}
+}
+
 /* called in rcu_read_lock() section */
 static int __mkroute_input(struct sk_buff *skb,
 			   const struct fib_result *res,
 			   struct in_device *in_dev,
 			   __be32 daddr, __be32 saddr, u32 tos,
-			   struct rtable **result)
+			   struct rtable **result, bool noref)
 {
 	struct rtable *rth;
 	int err;
@@ -2130,6 +2271,7 @@ static int __mkroute_input(struct sk_buff *skb,
 	unsigned int flags = 0;
 	__be32 spec_dst;
 	u32 itag;
+	bool do_cache;
 
 	/* get a working reference to the output device */
 	out_dev = __in_dev_get_rcu(FIB_RES_DEV(*res));
@@ -2172,6 +2314,26 @@ static int __mkroute_input(struct sk_buff *skb,
 		}
 	}
 
+	do_cache = rt_nh_input_cacheable(dev_net(in_dev->dev), skb, res,
+					 flags, itag, daddr);
+	if (do_cache) {
+		rth = rt_nh_input_get(&FIB_RES_NH(*res),
+				      in_dev->dev->ifindex, flags);
+		if (rth) {
+			if (noref) {
+				dst_use_noref(&rth->dst, jiffies);
+				skb_dst_set_noref(skb, &rth->dst);
+			} else {
+				dst_use(&rth->dst, jiffies);
+				skb_dst_set(skb, &rth->dst);
+			}
+			RT_CACHE_STAT_INC(in_hit);
+			*result = NULL;
+			err = 0;
+			goto cleanup;
+		}
+	}
+
 	rth = rt_dst_alloc(out_dev->dev,
 			   IN_DEV_CONF_GET(in_dev, NOPOLICY),
 			   IN_DEV_CONF_GET(out_dev, NOXFRM));
@@ -2201,8 +2363,31 @@ static int __mkroute_input(struct sk_buff *skb,
 	rth->dst.input = ip_forward;
 	rth->dst.output = ip_output;
 
+	if (do_cache) {
+		/* Shared by every destination behind this nexthop */
+		rth->dst.flags |= DST_NOPEER;
+		rth->rt_key_dst = 0;
+		rth->rt_key_src = 0;
+		rth->rt_key_tos = 0;
+		rth->rt_dst = 0;
+		rth->rt_src = 0;
+		rth->rt_mark = 0;
+	}
+
 	rt_set_nexthop(rth, NULL, res, res->fi, res->type, itag);
 
+	if (do_cache) {
+		err = rt_bind_neighbour(rth);
+		if (err) {
+			rth->dst.flags |= DST_NOCACHE;
+			ip_rt_put(rth);
+			goto cleanup;
+		}
+		rt_nh_input_set(res->fi, &FIB_RES_NH(*res), rth);
+		skb_dst_set(skb, &rth->dst);
+		rth = NULL;
+	}
+
 	*result = rth;
 	err = 0;
  cleanup:
@@ -2213,7 +2398,7 @@ static int ip_mkroute_input(struct sk_buff *skb,
 			    struct fib_result *res,
 			    const struct flowi4 *fl4,
 			    struct in_device *in_dev,
-			    __be32 daddr, __be32 saddr, u32 tos)
+			    __be32 daddr, __be32 saddr, u32 tos, bool noref)
 {
 	struct rtable* rth = NULL;
 	int err;
@@ -2225,10 +2410,14 @@ static int ip_mkroute_input(struct sk_buff *skb,
 #endif
 
 	/* create a routing cache entry */
-	err = __mkroute_input(skb, res, in_dev, daddr, saddr, tos, &rth);
+	err = __mkroute_input(skb, res, in_dev, daddr, saddr, tos, &rth, noref);
 	if (err)
 		return err;
 
+	/* already attached through the nexthop cache */
+	if (!rth)
+		return 0;
+
 	/* put it into the cache */
 	hash = rt_hash(daddr, saddr, fl4->flowi4_iif,
 		       rt_genid(dev_net(rth->dst.dev)));
@@ -2250,7 +2439,7 @@ static int ip_mkroute_input(struct sk_buff *skb,
  */
 
 static int ip_route_input_slow(struct sk_buff *skb, __be32 daddr, __be32 saddr,
-			       u8 tos, struct net_device *dev)
+			       u8 tos, struct net_device *dev, bool noref)
 {
 	struct fib_result res;
 	struct in_device *in_dev = __in_dev_get_rcu(dev);
@@ -2327,7 +2516,8 @@ static int ip_route_input_slow(struct sk_buff *skb, __be32 daddr, __be32 saddr,
 	if (res.type != RTN_UNICAST)
 		goto martian_destination;
 
-	err = ip_mkroute_input(skb, &res, &fl4, in_dev, daddr, saddr, tos);
+	err = ip_mkroute_input(skb, &res, &fl4, in_dev, daddr, saddr, tos,
+			       noref);
 out:	return err;
 
 brd_input:
@@ -2507,7 +2697,7 @@ skip_cache:
 		rcu_read_unlock();
 		return -EINVAL;
 	}
-	res = ip_route_input_slow(skb, daddr, saddr, tos, dev);
+	res = ip_route_input_slow(skb, daddr, saddr, tos, dev, noref);
 	rcu_read_unlock();
 	return res;
 }
@@ -3223,6 +3413,25 @@ static int ipv4_sysctl_rtcache_flush(ctl_table *__ctl, int write,
 	return -EINVAL;
 }
 
+static int ipv4_sysctl_rt_nocache(ctl_table *ctl, int write,
+				  void __user *buffer,
+				  size_t *lenp, loff_t *ppos)
+{
+	int old = ip_rt_nocache;
+	int ret = proc_dointvec(ctl, write, buffer, lenp, ppos);
+
+	if (write && ret == 0 && ip_rt_nocache != old) {
+		struct net *net;
+
+		/* Entries already hashed are reaped by the expire worker */
+		rtnl_lock();
+		for_each_net(net)
+			rt_cache_flush(net, -1);
+		rtnl_unlock();
+	}
+	return ret;
+}
+
 static ctl_table ipv4_route_table[] = {
 	{
 		.procname	= "gc_thresh",
@@ -3238,6 +3447,13 @@ static ctl_table ipv4_route_table[] = {
 		.mode		= 0644,
 		.proc_handler	= proc_dointvec,
 	},
+	{
+		.procname	= "nocache",
+		.data		= &ip_rt_nocache,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= ipv4_sysctl_rt_nocache,
+	},
 	{
 		/*  Deprecated. Use gc_min_interval_ms */
 
@@ -0,0 +1,120 @@
+/*
+ * TCP Fast Open: send and accept data in the SYN of a connection.
+ *
+ * The server hands out an opaque cookie derived from the client's IP
+ * address. A client that presents a valid cookie in a later SYN may have
+ * the data carried in that SYN delivered to the application before the
+ * three-way handshake completes. Clients remember the cookie, together
+ * with the MSS and a history of failed attempts, in the inet_peer entry
+ * of the destination.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/cache.h>
+#include <linux/cryptohash.h>
+#include <linux/random.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <net/inetpeer.h>
+#include <net/tcp.h>
+
+int sysctl_tcp_fastopen __read_mostly = TFO_CLIENT_ENABLE;
+
+static u32 tcp_fastopen_secret[MD5_MESSAGE_BYTES / 4] ____cacheline_aligned;
+
+/* Serializes updates of the Fast Open fields of struct inet_peer. */
+static DEFINE_SEQLOCK(tcp_fastopen_seqlock);
+
+static int __init tcp_fastopen_init(void)
+{
+	BUILD_BUG_ON(sizeof(((struct inet_peer *)0)->tfo_cookie) !=
+		     TCP_FASTOPEN_COOKIE_MAX);
+
+	get_random_bytes(tcp_fastopen_secret, sizeof(tcp_fastopen_secret));
+	return 0;
+}
+late_initcall(tcp_fastopen_init);
+
+/* Computes the Fast Open cookie handed out to the client at @addr. The
+ * cookie is a keyed hash of the address, so it can be validated without
+ * keeping any per-client state on the server.
+ */
+void tcp_fastopen_cookie_gen(__be32 addr, struct tcp_fastopen_cookie *foc)
+{
+	u32 hash[MD5_DIGEST_WORDS];
+
+	BUILD_BUG_ON(sizeof(hash) < TCP_FASTOPEN_COOKIE_SIZE);
+
+	hash[0] = (__force u32)addr;
+	hash[1] = tcp_fastopen_secret[13];
+	hash[2] = tcp_fastopen_secret[14];
+	hash[3] = tcp_fastopen_secret[15];
+
+	md5_transform(hash, tcp_fastopen_secret);
+
+	memcpy(foc->val, hash, TCP_FASTOPEN_COOKIE_SIZE);
+	foc->len = TCP_FASTOPEN_COOKIE_SIZE;
+}
+
+void tcp_fastopen_cache_get(struct sock *sk, u16 *mss,
+			    struct tcp_fastopen_cookie *cookie,
+			    int *syn_loss, unsigned long *last_syn_loss)
+{
+	const struct inet_connection_sock *icsk = inet_csk(sk);
+	struct inet_peer *peer;
+	bool release_it;
+
+	peer = icsk->icsk_af_ops->get_peer(sk, &release_it);
+	if (peer) {
+		unsigned int seq;
+
+		do {
+			seq = read_seqbegin(&tcp_fastopen_seqlock);
+			if (peer->tfo_mss)
+				*mss = peer->tfo_mss;
+			cookie->len = peer->tfo_cookie_len;
+			memcpy(cookie->val, peer->tfo_cookie,
+			       sizeof(cookie->val));
+			*syn_loss = peer->tfo_syn_loss;
+			*last_syn_loss = *syn_loss ? peer->tfo_last_syn_loss : 0;
+		} while (read_seqretry(&tcp_fastopen_seqlock, seq));
+
+		if (release_it)
+			inet_putpeer(peer);
+	}
+}
+
+void tcp_fastopen_cache_set(struct sock *sk, u16 mss,
+			    struct tcp_fastopen_cookie *cookie, bool syn_lost)
+{
+	const struct inet_connection_sock *icsk = inet_csk(sk);
+	struct inet_peer *peer;
+	bool release_it;
+
+	peer = icsk->icsk_af_ops->get_peer(sk, &release_it);
+	if (peer) {
+		write_seqlock_bh(&tcp_fastopen_seqlock);
+		peer->tfo_mss = mss;
+		if (cookie->len > 0) {
+			peer->tfo_cookie_len = cookie->len;
+			memcpy(peer->tfo_cookie, cookie->val,
+			       sizeof(peer->tfo_cookie));
+		}
+		if (syn_lost) {
+			if (peer->tfo_syn_loss != (u8)~0U)
+				peer->tfo_syn_loss++;
+			peer->tfo_last_syn_loss = jiffies;
+		} else
+			peer->tfo_syn_loss = 0;
+		write_sequnlock_bh(&tcp_fastopen_seqlock);
+
+		if (release_it)
+			inet_putpeer(peer);
+	}
+}
@@ -733,6 +733,7 @@ static struct sk_buff *__pfkey_xfrm_state2msg(const struct xfrm_state *x,
 	struct sadb_x_sa2 *sa2;
 	struct sadb_x_sec_ctx *sec_ctx;
 	struct xfrm_sec_ctx *xfrm_ctx;
+	struct xfrm_lifetime_cur curlft;
 	int ctx_size = 0;
 	int size;
 	int auth_key_size = 0;
@@ -868,10 +869,11 @@ static struct sk_buff *__pfkey_xfrm_state2msg(const struct xfrm_state *x,
 	lifetime->sadb_lifetime_len =
 		sizeof(struct sadb_lifetime)/sizeof(uint64_t);
 	lifetime->sadb_lifetime_exttype = SADB_EXT_LIFETIME_CURRENT;
-	lifetime->sadb_lifetime_allocations = x->curlft.packets;
-	lifetime->sadb_lifetime_bytes = x->curlft.bytes;
-	lifetime->sadb_lifetime_addtime = x->curlft.add_time;
-	lifetime->sadb_lifetime_usetime = x->curlft.use_time;
+	xfrm_state_get_curlft(x, &curlft);
+	lifetime->sadb_lifetime_allocations = curlft.packets;
+	lifetime->sadb_lifetime_bytes = curlft.bytes;
+	lifetime->sadb_lifetime_addtime = curlft.add_time;
+	lifetime->sadb_lifetime_usetime = curlft.use_time;
 	/* src address */
 	addr = (struct sadb_address*) skb_put(skb,
 					      sizeof(struct sadb_address)+sockaddr_size);
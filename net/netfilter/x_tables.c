@@ -722,6 +722,11 @@ void xt_free_table_info(struct xt_table_info *info)
 
 	free_percpu(info->stackptr);
 
+	if (info->index_size <= PAGE_SIZE)
+		kfree(info->index);
+	else
+		vfree(info->index);
+
 	kfree(info);
 }
 EXPORT_SYMBOL(xt_free_table_info);
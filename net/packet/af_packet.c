@@ -294,6 +294,7 @@ struct packet_sock {
 	unsigned int		tp_reserve;
 	unsigned int		tp_loss:1;
 	unsigned int		tp_tstamp;
+	int			(*xmit)(struct sk_buff *skb);
 	struct packet_type	prot_hook ____cacheline_aligned_in_smp;
 };
 
@@ -1936,6 +1937,77 @@ ring_is_full:
 	goto drop_n_restore;
 }
 
+static bool packet_skb_needs_linearize(struct sk_buff *skb,
+				       netdev_features_t features)
+{
+	if (skb_has_frag_list(skb) && !(features & NETIF_F_FRAGLIST))
+		return true;
+	if (skb_shinfo(skb)->nr_frags && !(features & NETIF_F_SG))
+		return true;
+#ifdef CONFIG_HIGHMEM
+	if (!(features & NETIF_F_HIGHDMA)) {
+		int i;
+
+		for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
+			if (PageHighMem(skb_frag_page(&skb_shinfo(skb)->frags[i])))
+				return true;
+	}
+#endif
+	return false;
+}
+
+/*
+ * Hand the skb straight to the driver, bypassing the qdisc layer and the
+ * taps of dev_queue_xmit().  There is no queueing: if the tx queue is
+ * stopped the packet is dropped and the caller is expected to retry.
+ */
+static int packet_direct_xmit(struct sk_buff *skb)
+{
+	struct net_device *dev = skb->dev;
+	const struct net_device_ops *ops = dev->netdev_ops;
+	struct netdev_queue *txq;
+	int ret = NETDEV_TX_BUSY;
+
+	if (unlikely(!netif_running(dev) || !netif_carrier_ok(dev)))
+		goto drop;
+
+	if (packet_skb_needs_linearize(skb, netif_skb_features(skb)) &&
+	    __skb_linearize(skb))
+		goto drop;
+
+	skb_set_queue_mapping(skb, raw_smp_processor_id() %
+				   dev->real_num_tx_queues);
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
+
+	local_bh_disable();
+	HARD_TX_LOCK(dev, txq, smp_processor_id());
+	if (!netif_xmit_frozen_or_stopped(txq)) {
+		ret = ops->ndo_start_xmit(skb, dev);
+		if (dev_xmit_complete(ret))
+			txq_trans_update(txq);
+	}
+	HARD_TX_UNLOCK(dev, txq);
+	local_bh_enable();
+
+	if (dev_xmit_complete(ret))
+		return ret;
+drop:
+	kfree_skb(skb);
+	return NET_XMIT_DROP;
+}
+
+/* Wake up pollers and senders waiting for a tx ring frame to complete. */
+static void tpacket_tx_wake(struct sock *sk)
+{
+	struct socket_wq *wq;
+
+	rcu_read_lock();
+	wq = rcu_dereference(sk->sk_wq);
+	if (wq_has_sleeper(wq))
+		wake_up_interruptible_poll(&wq->wait, POLLOUT | POLLWRNORM);
+	rcu_read_unlock();
+}
+
 static void tpacket_destruct_skb(struct sk_buff *skb)
 {
 	struct packet_sock *po = pkt_sk(skb->sk);
@@ -1947,6 +2019,7 @@ static void tpacket_destruct_skb(struct sk_buff *skb)
 		BUG_ON(atomic_read(&po->tx_ring.pending) == 0);
 		atomic_dec(&po->tx_ring.pending);
 		__packet_set_status(po, ph, TP_STATUS_AVAILABLE);
+		tpacket_tx_wake(skb->sk);
 	}
 
 	sock_wfree(skb);
@@ -2064,6 +2137,8 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 	int len_sum = 0;
 	int status = 0;
 	int hlen, tlen;
+	bool need_wait = !(msg->msg_flags & MSG_DONTWAIT);
+	long timeo = 0;
 
 	mutex_lock(&po->pg_vec_lock);
 
@@ -2102,12 +2177,29 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 	if (size_max > dev->mtu + reserve)
 		size_max = dev->mtu + reserve;
 
+	timeo = sock_sndtimeo(&po->sk, !need_wait);
+
+	/*
+	 * Send every frame the user has marked TP_STATUS_SEND_REQUEST in one
+	 * go.  Blocking callers then sleep until the frames in flight have
+	 * been released by the driver, instead of spinning on the ring.
+	 */
 	do {
 		ph = packet_current_frame(po, &po->tx_ring,
 				TP_STATUS_SEND_REQUEST);
 
 		if (unlikely(ph == NULL)) {
-			schedule();
+			if (need_wait && atomic_read(&po->tx_ring.pending)) {
+				timeo = wait_event_interruptible_timeout(
+					*sk_sleep(&po->sk),
+					!atomic_read(&po->tx_ring.pending),
+					timeo);
+				if (timeo <= 0) {
+					err = !timeo ? -ETIMEDOUT : -ERESTARTSYS;
+					goto out_put;
+				}
+			}
+			/* check for frames queued in the meantime */
 			continue;
 		}
 
@@ -2143,7 +2235,7 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 		atomic_inc(&po->tx_ring.pending);
 
 		status = TP_STATUS_SEND_REQUEST;
-		err = dev_queue_xmit(skb);
+		err = po->xmit(skb);
 		if (unlikely(err > 0)) {
 			err = net_xmit_errno(err);
 			if (err && __packet_get_status(po, ph) ==
@@ -2161,9 +2253,7 @@ static int tpacket_snd(struct packet_sock *po, struct msghdr *msg)
 		packet_increment_head(&po->tx_ring);
 		len_sum += tp_len;
 	} while (likely((ph != NULL) ||
-			((!(msg->msg_flags & MSG_DONTWAIT)) &&
-			 (atomic_read(&po->tx_ring.pending))))
-		);
+			(need_wait && atomic_read(&po->tx_ring.pending))));
 
 	err = len_sum;
 	goto out_put;
@@ -2380,7 +2470,7 @@ static int packet_snd(struct socket *sock,
 	 *	Now send it
 	 */
 
-	err = dev_queue_xmit(skb);
+	err = po->xmit(skb);
 	if (err > 0 && (err = net_xmit_errno(err)) != 0)
 		goto out_unlock;
 
@@ -2607,6 +2697,7 @@ static int packet_create(struct net *net, struct socket *sock, int protocol,
 	po = pkt_sk(sk);
 	sk->sk_family = PF_PACKET;
 	po->num = proto;
+	po->xmit = dev_queue_xmit;
 
 	sk->sk_destruct = packet_sock_destruct;
 	sk_refcnt_debug_inc(sk);
@@ -3204,6 +3295,18 @@ packet_setsockopt(struct socket *sock, int level, int optname, char __user *optv
 		po->tp_tstamp = val;
 		return 0;
 	}
+	case PACKET_QDISC_BYPASS:
+	{
+		int val;
+
+		if (optlen != sizeof(val))
+			return -EINVAL;
+		if (copy_from_user(&val, optval, sizeof(val)))
+			return -EFAULT;
+
+		po->xmit = val ? packet_direct_xmit : dev_queue_xmit;
+		return 0;
+	}
 	case PACKET_FANOUT:
 	{
 		int val;
@@ -3329,6 +3432,12 @@ static int packet_getsockopt(struct socket *sock, int level, int optname,
 		val = po->tp_tstamp;
 		data = &val;
 		break;
+	case PACKET_QDISC_BYPASS:
+		if (len > sizeof(int))
+			len = sizeof(int);
+		val = po->xmit == packet_direct_xmit;
+		data = &val;
+		break;
 	case PACKET_FANOUT:
 		if (len > sizeof(int))
 			len = sizeof(int);
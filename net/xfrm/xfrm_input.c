@@ -219,8 +219,7 @@ resume:
 
 		x->repl->advance(x, seq);
 
-		x->curlft.bytes += skb->len;
-		x->curlft.packets++;
+		__xfrm_state_lft_add(x, skb->len);
 
 		spin_unlock(&x->lock);
 
@@ -38,6 +38,25 @@ static int xfrm_skb_check_space(struct sk_buff *skb)
 	return pskb_expand_head(skb, nhead, ntail, GFP_ATOMIC);
 }
 
+/*
+ * Take the lifetime and sequence number of the packet without x->lock.
+ * Returns -EAGAIN if the state needs the locked path.
+ */
+static int xfrm_output_nolock(struct xfrm_state *x, struct sk_buff *skb)
+{
+	struct net *net = xs_net(x);
+	int err;
+
+	if (!x->repl->overflow_nolock || xfrm_aevent_is_on(net) ||
+	    !xfrm_state_lft_add(x, skb->len))
+		return -EAGAIN;
+
+	err = x->repl->overflow_nolock(x, skb);
+	if (err)
+		XFRM_INC_STATS(net, LINUX_MIB_XFRMOUTSTATESEQERROR);
+	return err;
+}
+
 static int xfrm_output_one(struct sk_buff *skb, int err)
 {
 	struct dst_entry *dst = skb_dst(skb);
@@ -60,6 +79,12 @@ static int xfrm_output_one(struct sk_buff *skb, int err)
 			goto error_nolock;
 		}
 
+		err = xfrm_output_nolock(x, skb);
+		if (likely(!err))
+			goto accounted;
+		if (err != -EAGAIN)
+			goto error_nolock;
+
 		spin_lock_bh(&x->lock);
 		err = xfrm_state_check_expire(x);
 		if (err) {
@@ -73,11 +98,11 @@ static int xfrm_output_one(struct sk_buff *skb, int err)
 			goto error;
 		}
 
-		x->curlft.bytes += skb->len;
-		x->curlft.packets++;
+		__xfrm_state_lft_add(x, skb->len);
 
 		spin_unlock_bh(&x->lock);
 
+accounted:
 		skb_dst_force(skb);
 
 		err = x->type->output(x, skb);
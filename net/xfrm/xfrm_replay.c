@@ -113,6 +113,37 @@ static int xfrm_replay_overflow(struct xfrm_state *x, struct sk_buff *skb)
 	return err;
 }
 
+/*
+ * Allocate the next output sequence number without x->lock.  Only valid
+ * while nobody listens for replay events, as those have to be sent with
+ * x->lock held.
+ */
+static int __xfrm_replay_overflow_nolock(struct xfrm_state *x,
+					 struct sk_buff *skb, __u32 *oseqp)
+{
+	u32 oseq;
+
+	if (!(x->type->flags & XFRM_TYPE_REPLAY_PROT))
+		return 0;
+
+	do {
+		oseq = ACCESS_ONCE(*oseqp);
+		if (unlikely(oseq == ~0U)) {
+			xfrm_audit_state_replay_overflow(x, skb);
+			return -EOVERFLOW;
+		}
+	} while (cmpxchg(oseqp, oseq, oseq + 1) != oseq);
+
+	XFRM_SKB_CB(skb)->seq.output.low = oseq + 1;
+	return 0;
+}
+
+static int xfrm_replay_overflow_nolock(struct xfrm_state *x,
+				       struct sk_buff *skb)
+{
+	return __xfrm_replay_overflow_nolock(x, skb, &x->replay.oseq);
+}
+
 static int xfrm_replay_check(struct xfrm_state *x,
 		      struct sk_buff *skb, __be32 net_seq)
 {
@@ -192,6 +223,12 @@ static int xfrm_replay_overflow_bmp(struct xfrm_state *x, struct sk_buff *skb)
 	return err;
 }
 
+static int xfrm_replay_overflow_nolock_bmp(struct xfrm_state *x,
+					   struct sk_buff *skb)
+{
+	return __xfrm_replay_overflow_nolock(x, skb, &x->replay_esn->oseq);
+}
+
 static int xfrm_replay_check_bmp(struct xfrm_state *x,
 				 struct sk_buff *skb, __be32 net_seq)
 {
@@ -481,6 +518,7 @@ static struct xfrm_replay xfrm_replay_legacy = {
 	.check		= xfrm_replay_check,
 	.notify		= xfrm_replay_notify,
 	.overflow	= xfrm_replay_overflow,
+	.overflow_nolock = xfrm_replay_overflow_nolock,
 };
 
 static struct xfrm_replay xfrm_replay_bmp = {
@@ -488,6 +526,7 @@ static struct xfrm_replay xfrm_replay_bmp = {
 	.check		= xfrm_replay_check_bmp,
 	.notify		= xfrm_replay_notify_bmp,
 	.overflow	= xfrm_replay_overflow_bmp,
+	.overflow_nolock = xfrm_replay_overflow_nolock_bmp,
 };
 
 static struct xfrm_replay xfrm_replay_esn = {
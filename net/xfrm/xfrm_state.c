@@ -369,6 +369,7 @@ static void xfrm_state_gc_destroy(struct xfrm_state *x)
 		xfrm_put_type(x->type);
 	}
 	security_xfrm_state_free(x);
+	free_percpu(x->pcpu_lft);
 	kfree(x);
 }
 
@@ -1334,6 +1335,7 @@ out:
 		if (!use_spi && memcmp(&x1->sel, &x->sel, sizeof(x1->sel)))
 			memcpy(&x1->sel, &x->sel, sizeof(x1->sel));
 		memcpy(&x1->lft, &x->lft, sizeof(x1->lft));
+		x1->lft_nolock = false;
 		x1->km.dying = 0;
 
 		tasklet_hrtimer_start(&x1->mtimer, ktime_set(1, 0), HRTIMER_MODE_REL);
@@ -1354,22 +1356,34 @@ EXPORT_SYMBOL(xfrm_state_update);
 
 int xfrm_state_check_expire(struct xfrm_state *x)
 {
+	struct xfrm_lifetime_cur curlft;
+
 	if (!x->curlft.use_time)
 		x->curlft.use_time = get_seconds();
 
 	if (x->km.state != XFRM_STATE_VALID)
 		return -EINVAL;
 
-	if (x->curlft.bytes >= x->lft.hard_byte_limit ||
-	    x->curlft.packets >= x->lft.hard_packet_limit) {
+	/*
+	 * In lockless mode all the per-CPU shares together cannot reach a
+	 * limit, so curlft alone decides.  Otherwise count whatever was
+	 * left in them when the state left that mode.
+	 */
+	if (x->lft_nolock)
+		curlft = x->curlft;
+	else
+		xfrm_state_get_curlft(x, &curlft);
+
+	if (curlft.bytes >= x->lft.hard_byte_limit ||
+	    curlft.packets >= x->lft.hard_packet_limit) {
 		x->km.state = XFRM_STATE_EXPIRED;
 		tasklet_hrtimer_start(&x->mtimer, ktime_set(0,0), HRTIMER_MODE_REL);
 		return -EINVAL;
 	}
 
 	if (!x->km.dying &&
-	    (x->curlft.bytes >= x->lft.soft_byte_limit ||
-	     x->curlft.packets >= x->lft.soft_packet_limit)) {
+	    (curlft.bytes >= x->lft.soft_byte_limit ||
+	     curlft.packets >= x->lft.soft_packet_limit)) {
 		x->km.dying = 1;
 		km_state_expired(x, 0, 0);
 	}
@@ -1377,6 +1391,125 @@ int xfrm_state_check_expire(struct xfrm_state *x)
 }
 EXPORT_SYMBOL(xfrm_state_check_expire);
 
+/*
+ * Lifetime accounting for the fast path.  Packets are counted in a
+ * per-CPU share of curlft, folded in under x->lock once it reaches a
+ * batch, so that a busy SA does not bounce x->lock between CPUs.
+ *
+ * This is only done while curlft is far enough from the limits that all
+ * shares together cannot cross one.  Close to a limit, every packet is
+ * accounted under x->lock and checked by xfrm_state_check_expire() as
+ * before, which also counts whatever was left in the shares when the
+ * state left lockless mode, so expiry stays exact.
+ */
+#define XFRM_LFT_BATCH_PACKETS	64
+#define XFRM_LFT_BATCH_BYTES	(64 << 10)
+
+struct xfrm_lft_pcpu {
+	u32	bytes;
+	u32	packets;
+};
+
+/* Called with x->lock held. */
+static void xfrm_state_lft_update_nolock(struct xfrm_state *x)
+{
+	u64 cpus = num_possible_cpus();
+	u64 packets = x->curlft.packets + cpus * XFRM_LFT_BATCH_PACKETS;
+	/* A share may overshoot the batch by one maximum sized packet */
+	u64 bytes = x->curlft.bytes + cpus * (XFRM_LFT_BATCH_BYTES + 65536);
+
+	x->lft_nolock = x->pcpu_lft && x->km.state == XFRM_STATE_VALID &&
+			x->curlft.use_time &&
+			packets < min(x->lft.soft_packet_limit,
+				      x->lft.hard_packet_limit) &&
+			bytes < min(x->lft.soft_byte_limit,
+				    x->lft.hard_byte_limit);
+	if (x->lft_nolock)
+		x->lft_pcpu_used = true;
+}
+
+/* Add to this CPU's share and take it if it reached a batch. */
+static bool xfrm_lft_pcpu_take(struct xfrm_state *x, u32 *bytes, u32 *packets)
+{
+	struct xfrm_lft_pcpu *lft;
+	bool full = false;
+
+	local_bh_disable();
+	lft = this_cpu_ptr(x->pcpu_lft);
+	lft->bytes += *bytes;
+	lft->packets += *packets;
+	if (lft->packets >= XFRM_LFT_BATCH_PACKETS ||
+	    lft->bytes >= XFRM_LFT_BATCH_BYTES) {
+		*bytes = lft->bytes;
+		*packets = lft->packets;
+		lft->bytes = 0;
+		lft->packets = 0;
+		full = true;
+	}
+	local_bh_enable();
+
+	return full;
+}
+
+/*
+ * Account a packet of len bytes to x without taking x->lock.  Returns
+ * false if the caller has to check the lifetime and account the packet
+ * under x->lock instead.
+ */
+bool xfrm_state_lft_add(struct xfrm_state *x, unsigned int len)
+{
+	u32 bytes = len, packets = 1;
+
+	if (!ACCESS_ONCE(x->lft_nolock) || x->km.state != XFRM_STATE_VALID)
+		return false;
+
+	if (xfrm_lft_pcpu_take(x, &bytes, &packets)) {
+		spin_lock_bh(&x->lock);
+		x->curlft.bytes += bytes;
+		x->curlft.packets += packets;
+		xfrm_state_lft_update_nolock(x);
+		spin_unlock_bh(&x->lock);
+	}
+	return true;
+}
+EXPORT_SYMBOL(xfrm_state_lft_add);
+
+/* Account a packet of len bytes to x, with x->lock held. */
+void __xfrm_state_lft_add(struct xfrm_state *x, unsigned int len)
+{
+	u32 bytes = len, packets = 1;
+
+	if (x->lft_nolock && !xfrm_lft_pcpu_take(x, &bytes, &packets))
+		return;
+
+	x->curlft.bytes += bytes;
+	x->curlft.packets += packets;
+	xfrm_state_lft_update_nolock(x);
+}
+EXPORT_SYMBOL(__xfrm_state_lft_add);
+
+/*
+ * curlft including the per-CPU shares.  States which never used lockless
+ * accounting have nothing there, so don't walk all CPUs for them.
+ */
+void xfrm_state_get_curlft(const struct xfrm_state *x,
+			   struct xfrm_lifetime_cur *curlft)
+{
+	int cpu;
+
+	*curlft = x->curlft;
+	if (!ACCESS_ONCE(x->lft_pcpu_used))
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct xfrm_lft_pcpu *lft = per_cpu_ptr(x->pcpu_lft, cpu);
+
+		curlft->bytes += ACCESS_ONCE(lft->bytes);
+		curlft->packets += ACCESS_ONCE(lft->packets);
+	}
+}
+EXPORT_SYMBOL(xfrm_state_get_curlft);
+
 struct xfrm_state *
 xfrm_state_lookup(struct net *net, u32 mark, const xfrm_address_t *daddr, __be32 spi,
 		  u8 proto, unsigned short family)
@@ -1990,6 +2123,10 @@ int __xfrm_init_state(struct xfrm_state *x, bool init_replay)
 			goto error;
 	}
 
+	/* Without it, the lifetime is simply accounted under x->lock */
+	if (!x->pcpu_lft)
+		x->pcpu_lft = alloc_percpu(struct xfrm_lft_pcpu);
+
 	x->km.state = XFRM_STATE_VALID;
 
 error:
@@ -473,6 +473,7 @@ static void xfrm_update_ae_params(struct xfrm_state *x, struct nlattr **attrs)
 		x->curlft.packets = ltime->packets;
 		x->curlft.add_time = ltime->add_time;
 		x->curlft.use_time = ltime->use_time;
+		x->lft_nolock = false;
 	}
 
 	if (et)
@@ -692,7 +693,7 @@ static void copy_to_user_state(struct xfrm_state *x, struct xfrm_usersa_info *p)
 	memcpy(&p->id, &x->id, sizeof(p->id));
 	memcpy(&p->sel, &x->sel, sizeof(p->sel));
 	memcpy(&p->lft, &x->lft, sizeof(p->lft));
-	memcpy(&p->curlft, &x->curlft, sizeof(p->curlft));
+	xfrm_state_get_curlft(x, &p->curlft);
 	memcpy(&p->stats, &x->stats, sizeof(p->stats));
 	memcpy(&p->saddr, &x->props.saddr, sizeof(p->saddr));
 	p->mode = x->props.mode;
@@ -1675,6 +1676,7 @@ static inline size_t xfrm_aevent_msgsize(struct xfrm_state *x)
 static int build_aevent(struct sk_buff *skb, struct xfrm_state *x, const struct km_event *c)
 {
 	struct xfrm_aevent_id *id;
+	struct xfrm_lifetime_cur curlft;
 	struct nlmsghdr *nlh;
 
 	nlh = nlmsg_put(skb, c->pid, c->seq, XFRM_MSG_NEWAE, sizeof(*id), 0);
@@ -1697,7 +1699,8 @@ static int build_aevent(struct sk_buff *skb, struct xfrm_state *x, const struct
 	else
 		NLA_PUT(skb, XFRMA_REPLAY_VAL, sizeof(x->replay), &x->replay);
 
-	NLA_PUT(skb, XFRMA_LTIME_VAL, sizeof(x->curlft), &x->curlft);
+	xfrm_state_get_curlft(x, &curlft);
+	NLA_PUT(skb, XFRMA_LTIME_VAL, sizeof(curlft), &curlft);
 
 	if (id->flags & XFRM_AE_RTHR)
 		NLA_PUT_U32(skb, XFRMA_REPLAY_THRESH, x->replay_maxdiff);